@@ -0,0 +1,141 @@
+#include "u.h"
+#include "libc.h"
+#include "dat.h"
+#include "fns.h"
+
+/*
+ * Open addressed tables with linear probing. An entry with no actions is
+ * free; deleting shifts later entries of the same run back so that lookups
+ * never need tombstones.
+ */
+static size_t
+hash(s64 in, size_t n)
+{
+	return ((u64)in * 0x9e3779b97f4a7c15ull) >> 32 & (n - 1);
+}
+
+static Bind *
+find(Bind *t, size_t n, s64 in)
+{
+	size_t i;
+
+	for (i = hash(in, n); t[i].act && t[i].in != in; i = (i + 1) & (n - 1))
+		;
+	return &t[i];
+}
+
+static void
+delete(Bind *t, size_t n, Bind *b)
+{
+	size_t i, j, h;
+
+	i = b - t;
+	for (j = (i + 1) & (n - 1); t[j].act; j = (j + 1) & (n - 1)) {
+		h = hash(t[j].in, n);
+		if (((j - h) & (n - 1)) >= ((j - i) & (n - 1))) {
+			t[i] = t[j];
+			i    = j;
+		}
+	}
+	t[i].act = 0;
+}
+
+u32
+lookupinput(Controller *c, s64 in)
+{
+	return find(c->bind, NBIND, in)->act;
+}
+
+int
+bindinput(Controller *c, s64 in, int act)
+{
+	Bind *b;
+
+	b = find(c->bind, NBIND, in);
+	if (!b->act) {
+		if (c->nbind >= NBIND / 2)
+			return -ENOSPC;
+		c->nbind++;
+		b->in = in;
+	}
+	b->act |= 1u << act;
+	return 0;
+}
+
+/* remove act from all keys, or from all pad inputs */
+void
+unbindinput(Controller *c, int act, bool pad)
+{
+	Bind *b;
+	uint  i;
+
+	for (i = 0; i < NBIND;) {
+		b = &c->bind[i];
+		if (!(b->act & (1u << act)) || (INKIND(b->in) != IKEY) != pad) {
+			i++;
+			continue;
+		}
+		b->act &= ~(1u << act);
+		if (b->act)
+			continue;
+		delete(c->bind, NBIND, b);
+		c->nbind--;
+	}
+}
+
+int
+padnum(Controller *c, s32 id)
+{
+	return (int)find(c->padid, nelem(c->padid), id)->act - 1;
+}
+
+/*
+ * Open the pad at device index i under the lowest free pad number. SDL
+ * reports pads that are present at startup as added too, so a pad that is
+ * already open is left alone.
+ */
+int
+addpad(Controller *c, int i)
+{
+	SDL_GameController *gc;
+	Bind *              b;
+	s32                 id;
+	int                 n;
+
+	id = SDL_JoystickGetDeviceInstanceID(i);
+	if (id < 0 || padnum(c, id) >= 0)
+		return 0;
+
+	for (n = 0; n < NPAD && c->pad[n]; n++)
+		;
+	if (n == NPAD)
+		return -ENOSPC;
+
+	gc = SDL_GameControllerOpen(i);
+	if (!gc)
+		return -ENODEV;
+
+	c->pad[n] = gc;
+	b         = find(c->padid, nelem(c->padid), id);
+	b->in     = id;
+	b->act    = n + 1;
+	memset(c->axisdown[n], 0, sizeof(c->axisdown[n]));
+	memset(c->buttondown[n], 0, sizeof(c->buttondown[n]));
+	return 0;
+}
+
+void
+delpad(Controller *c, s32 id)
+{
+	Bind *b;
+	int   n;
+
+	b = find(c->padid, nelem(c->padid), id);
+	if (!b->act)
+		return;
+
+	n = b->act - 1;
+	SDL_GameControllerClose(c->pad[n]);
+	c->pad[n] = NULL;
+	delete(c->padid, nelem(c->padid), b);
+}
@@ -8,25 +8,337 @@ typedef struct {
 	u32  addr;
 } Inst;
 
+/*
+ * Phosphor decay is driven by guest time, counted in 5us memory cycles.
+ * The half-life is about one pass through the Spacewar main loop, so the
+ * afterglow matches the old halve-per-frame look at nominal speed.
+ */
+enum {
+	HALFLIFE  = 8192,
+	DECAYSTEP = HALFLIFE / 16,
+	NDECAY    = 16 * 8,
+};
+
+/* no source line for a word */
+enum {
+	NOSYM = 0xffff,
+};
+
+/* points kept per frame when a machine lists what it plots, y << 9 | x */
+enum {
+	NPOINT = 8192,
+};
+
+/* length of a frame for programs that have no frame PC */
+enum {
+	FRAMECYCLES = 8192,
+};
+
+/*
+ * Save states start with a magic and version. Registers and memory words
+ * are stored as 3 bytes each, and memory is stored as runs of words that
+ * differ from the pristine program image.
+ */
+#define STATEMAGIC "SWST"
+
+enum {
+	STATEVERSION = 1,
+	STATEMAX     = 32 * 1024,
+	NSLOT        = 10,
+	OLDSTATESIZE = 4 * 4 + 010000 * 4 + 7 + 7 + 1 + 010000 * 4,
+};
+
+/*
+ * Memory is tracked in pages of 64 words, one bit per page, so a set of
+ * pages fits in a u64.
+ */
+enum {
+	PAGESIZE = 64,
+	NPAGE    = 010000 / PAGESIZE,
+};
+
+/*
+ * Rewind history. Each frame records the registers, the cycle count the
+ * frame was marked at and the written map at a frame boundary, and the
+ * pages that changed before the next boundary, as they were at the
+ * boundary. The saved pages live in a ring shared by all frames.
+ */
 typedef struct {
 	Word ac, io, pc, ov;
-	Word mem[010000];
-	u32  sym[010000];
 	u8   flag[7];
 	u8   sense[7];
 	u8   halt;
+	u64  cycles;
+	u64  framemark;
+	u32  frame;
+	u64  pages;
+	uint page;
+	u64  written[010000 / 64];
+} Histframe;
+
+typedef struct {
+	Histframe *frame;
+	uint       nframe, fhead, fcount;
 
+	Word (*page)[PAGESIZE];
+	uint npage, phead, pcount;
+
+	Word shadow[010000];
+} Hist;
+
+/* ten minutes of rewind, at most 16 pages a frame or about 150MB */
+enum {
+	MAXREWIND = 10 * 60 * 60,
+};
+
+/*
+ * Forks share unchanged memory pages. A page is immutable once shared and
+ * is freed when its last reference goes away.
+ */
+typedef struct {
+	SDL_atomic_t ref;
+	Word         w[PAGESIZE];
+} Page;
+
+typedef struct {
+	Word ac, io, pc, ov;
+	u8   flag[7];
+	u8   sense[7];
+	u8   halt;
 	Word ctl;
-	u32  frametime;
+	u64  cycles;
+	u64  framemark;
+	u32  nframe;
+	Page *page[NPAGE];
+} Fork;
+
+/*
+ * Input movies record the control word each time the guest reads it with
+ * a different value, keyed by frame number and the read's index within
+ * the frame. Playing one back feeds the same values to the same reads.
+ * Periodic keyframes hold a save state to seek from.
+ */
+typedef struct {
+	u32 frame;
+	u32 off;
+} Keyframe;
+
+typedef struct {
+	FILE *fp;
+	bool  play;
+	u8    version;
+	u32   frame, read;
+	Word  ctl;
+
+	u8 * buf, *start, *p, *e;
+	u32  evframe, evread;
+	Word evctl;
+	u32  endframe, sum;
+	u64  endcycles;
+
+	Keyframe *key;
+	uint      nkey, keycap;
+} Movie;
+
+/* netplay session, see net.c */
+typedef struct Net Net;
+
+/*
+ * Spectators get the intensity plane as the tiles that changed in each
+ * shown frame, see spec.c.
+ */
+enum {
+	TILE      = 16,
+	SPECTILE  = 1,
+	SPECCLEAR = 2,
+};
+
+typedef struct {
+	u8 x, y;
+	u8 pix[TILE][TILE];
+} Tile;
+
+typedef struct Spec Spec;
+
+/*
+ * Where Spacewar keeps its state, from the listing in spacewar_rom.c. The
+ * object table is a set of parallel arrays with one word per object, the
+ * first two objects being the ships; the tables from NOM on have one word
+ * per ship. MTB holds the routine that moves each object, 0 if unused.
+ */
+enum {
+	NOBJ = 030,
+
+	MTB = 03365,
+	NX1 = 03415,
+	NY1 = 03445,
+	NA1 = 03475,
+	NB1 = 03525,
+	NDX = 03555,
+	NDY = 03605,
+	NOM = 03635,
+	NTH = 03637,
+	NFU = 03641,
+	NTR = 03643,
+	NOT = 03645,
+	NCO = 03647,
+	NH1 = 03651,
+	NH2 = 03653,
+	NH3 = 03655,
+	NH4 = 03657,
+
+	NTD = 03131,
+	SC1 = 03132,
+	SC2 = 03133,
+	GCT = 03135,
+
+	SS1 = 02310,
+	SS2 = 02314,
+	MEX = 02052,
+	TCR = 02136,
+	HP1 = 02170,
+	HP3 = 02246,
+};
+
+/*
+ * Game state decoded from memory at a frame boundary. Positions and
+ * velocities are signed, with the screen spanning -0377777 to 0377777 on
+ * each axis; angles run from -0311040 to 0311040 for a full turn.
+ */
+enum {
+	ONONE,
+	OSHIP,
+	OTORP,
+	OBLAST,
+	OHYPER,
+};
+
+typedef struct {
+	u8  kind;
+	u8  pad;
+	s16 life;
+	s32 x, y;
+	s32 dx, dy;
+} Object;
+
+typedef struct {
+	u8  alive;
+	u8  hyper;
+	s16 torps;
+	s16 jumps;
+	s16 recharge;
+	s32 x, y;
+	s32 dx, dy;
+	s32 angle;
+	s32 spin;
+	s32 fuel;
+} Ship;
+
+/*
+ * Game events, seen as the guest writes the object table's ship entries
+ * and the scores. A ship is destroyed when its entry becomes an explosion,
+ * and a round is over when the table is set up again with the first ship
+ * after the first frame; a round that ends with one ship left also scores.
+ * An event's frame is what nframe will be at the end of the frame.
+ */
+enum {
+	EDEATH = 1,
+	ESCORE,
+	EROUND,
+};
+
+enum {
+	NEVENT = 16,
+};
+
+typedef struct {
+	u32 frame;
+	u8  type;
+	u8  player;
+	u16 score;
+} Event;
+
+typedef struct {
+	u32    frame;
+	u16    score[2];
+	u16    nobj;
+	u16    pad;
+	Ship   ship[2];
+	Object obj[NOBJ];
+} Game;
+
+/* batch of machines for training agents, see env.c */
+typedef struct Env Env;
+
+/* side 0 runs without observations, for agents that only use readgame */
+typedef struct {
+	uint n;
+	uint side;
+	uint stack;
+	uint repeat;
+	uint limit;
+	bool points;
+} Envconf;
+
+/*
+ * Header of a shared memory segment holding a machine, see share.c. The
+ * field offsets are relative to the Mach, which starts at machoff.
+ */
+typedef struct {
+	char         magic[4];
+	u32          version;
+	u32          size;
+	u32          machoff;
+	u32          machsize;
+	u32          ac, io, pc, ov;
+	u32          flag, sense, halt;
+	u32          cycles, nframe;
+	u32          mem, pix;
+	u32          dx, dy;
+	SDL_atomic_t seq;
+	u32          frame;
+} Shared;
+
+typedef struct {
+	Word ac, io, pc, ov;
+	Word mem[010000];
+	u64  dirty;
+	u64  stale;
+	Page *base[NPAGE];
+	u64  written[010000 / 64];
+	u8   flag[7];
+	u8   sense[7];
+	u8   halt;
+
+	Word          ctl;
+	SDL_atomic_t *ctlsrc;
+	Word          framepc;
+	bool          nodraw;
+	u32           frametime;
+	u64           cycles;
+	u64           framemark;
+	u32           nframe;
+	u64           fadetime;
 
-	SDL_Texture *tex;
-	u32          nframe;
 	u32          cmap[256];
+	u16          decay[NDECAY];
 	u8           pix[512][512];
+	u8           hit[2][512][512];
+	u8           hitrow[2][512];
+	u8           live[512];
+	u32          rowgen[512];
+	u32          gen;
+	int          plane;
 	int          dx, dy;
+	u32 *        pts;
+	uint         npts;
+	Event *      ev;
+	uint         nev;
 
-	u8   state[10][64 * 1024];
 	uint statepos;
+
+	Hist * hist;
+	Movie *movie;
 } Mach;
 
 enum {
@@ -91,21 +403,65 @@ enum {
 	BPU,
 	BES,
 	BFS,
+	BRW,
 	BMAX
 };
 
+/*
+ * An input is a key, or a button or axis on a numbered pad, packed into
+ * one value. Bindings are hashed from an input to the set of actions bound
+ * to it, one bit per action, so an action can have any number of inputs.
+ */
+enum {
+	IKEY = 1,
+	IBUTTON,
+	IAXIS,
+};
+
+#define INPUT(kind, pad, code) ((s64)(kind) << 40 | (s64)(pad) << 32 | (u32)(code))
+#define INKIND(in) ((int)((in) >> 40))
+#define INPAD(in) ((int)(((in) >> 32) & 0xff))
+#define INCODE(in) ((s32)((in)&0xffffffff))
+
+enum {
+	NBIND = 256,
+	NPAD  = 16,
+};
+
 typedef struct {
-	s64 key[BMAX];
-	s64 button[BMAX];
-	s64 axis[BMAX];
-	s32 axis_threshold;
+	s64 in;
+	u32 act;
+} Bind;
 
-	SDL_GameController **ctx;
-	int                  nctx;
+typedef struct {
+	Bind bind[NBIND];
+	uint nbind;
+	s32  axis_threshold;
+
+	/* open pads by pad number, and joystick instance id to pad number + 1 */
+	SDL_GameController *pad[NPAD];
+	Bind                padid[2 * NPAD];
+
+	u8 axisdown[NPAD][SDL_CONTROLLER_AXIS_MAX];
+	u8 buttondown[NPAD][SDL_CONTROLLER_BUTTON_MAX];
+	u8 held[BMAX];
 } Controller;
 
+/* the largest settings the config file may give; larger ones are clamped */
+enum {
+	MAXRUNAHEAD = 8,
+	MAXNETDELAY = 4,
+	MAXNETLAG   = 1000,
+	MAXNETLOSS  = 100,
+};
+
 typedef struct {
 	double fps;
 	double frameskip;
 	u8     white;
+	uint   rewind;
+	uint   runahead;
+	uint   netdelay;
+	uint   netlag;
+	uint   netloss;
 } Config;
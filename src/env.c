@@ -0,0 +1,231 @@
+#include "u.h"
+#include "libc.h"
+#include "dat.h"
+#include "fns.h"
+
+/*
+ * Batches of machines for training agents. Each step runs every machine
+ * for a number of frames with a given control word and writes back its
+ * observation, the reward and whether the episode ended, all into arrays
+ * the caller owns. Nothing here uses the SDL video or event subsystems,
+ * and nothing is allocated after openenv.
+ *
+ * An observation is a stack of the last few downsampled frames, oldest
+ * first, each the max of the last two frames emulated so that objects
+ * drawn on alternate frames are not lost. Frames are either the phosphor
+ * display shrunk to side x side, or only the points plotted in the frame,
+ * in which case the display is never rasterised at all. With side 0 there
+ * are no observations and nothing is plotted; agents read the decoded game
+ * state with stateenv instead.
+ *
+ * The reward is from player 1's side: +1 for each point player 1 scores
+ * and -1 for each point player 2 scores. An episode ends on the frame its
+ * round is decided: when a score changes, when a round ends in a draw,
+ * when the machine halts or after the frame limit. The machine is then
+ * reset, so the observation returned with done set is the first one of the
+ * next episode.
+ */
+struct Env {
+	Envconf c;
+	size_t  size;
+	Mach *  m;
+	u32 *   pts;
+	Event * ev;
+
+	/* per machine: the last two frames, and the stack as a ring */
+	u8 *  frame;
+	uint *cur;
+	u8 *  stack;
+	uint *head;
+};
+
+static void
+restart(Env *e, uint i)
+{
+	Mach *m;
+
+	m = &e->m[i];
+	reset(m);
+	memset(m->pix, 0, sizeof(m->pix));
+	memset(m->hit, 0, sizeof(m->hit));
+	memset(m->hitrow, 0, sizeof(m->hitrow));
+	memset(m->live, 0, sizeof(m->live));
+	m->plane       = 0;
+	m->fadetime    = 0;
+	m->ctl         = 0;
+	m->npts        = 0;
+	m->nev         = 0;
+	e->cur[i]      = 0;
+	e->head[i]     = 0;
+	if (e->c.side) {
+		memset(e->frame + i * 2 * e->size, 0, 2 * e->size);
+		memset(e->stack + i * e->c.stack * e->size, 0, e->c.stack * e->size);
+	}
+}
+
+/*
+ * Make a batch as described by c: n machines, side x side frames stacked
+ * stack deep, each step running repeat frames. A limit of 0 lets episodes
+ * run until a round is decided.
+ */
+int
+openenv(Env **ep, Envconf *c)
+{
+	Config conf;
+	Env *  e;
+	uint   i;
+
+	if (c->n == 0 || c->side > 512 || (c->side && c->stack == 0) || c->repeat == 0)
+		return -EINVAL;
+
+	memset(&conf, 0, sizeof(conf));
+	e        = ecalloc(1, sizeof(*e));
+	e->c     = *c;
+	e->size  = c->side * c->side;
+	e->m     = ecalloc(c->n, sizeof(*e->m));
+	e->ev    = ecalloc(c->n * NEVENT, sizeof(*e->ev));
+	e->cur   = ecalloc(c->n, sizeof(*e->cur));
+	e->head  = ecalloc(c->n, sizeof(*e->head));
+	if (c->side) {
+		e->frame = ecalloc(c->n * 2, e->size);
+		e->stack = ecalloc(c->n * c->stack, e->size);
+	}
+	if (c->side && c->points)
+		e->pts = ecalloc(c->n * NPOINT, sizeof(*e->pts));
+	for (i = 0; i < c->n; i++) {
+		initmach(&e->m[i], &conf);
+		e->m[i].ev     = e->ev + i * NEVENT;
+		e->m[i].nodraw = c->side == 0;
+		if (c->side && c->points) {
+			e->m[i].pts    = e->pts + i * NPOINT;
+			e->m[i].nodraw = true;
+		}
+	}
+	*ep = e;
+	return 0;
+}
+
+void
+closeenv(Env *e)
+{
+	if (!e)
+		return;
+	free(e->pts);
+	free(e->head);
+	free(e->stack);
+	free(e->cur);
+	free(e->frame);
+	free(e->ev);
+	free(e->m);
+	free(e);
+}
+
+/* run one frame, and keep it if it is one of the two the step pools */
+static void
+runframe(Env *e, uint i, bool keep)
+{
+	Mach *m;
+	u8 *  f;
+
+	m = &e->m[i];
+	do
+		step(m);
+	while (!frameend(m) && !m->halt);
+
+	if (e->c.side == 0)
+		return;
+	if (e->c.points) {
+		f = e->frame + (i * 2 + (e->cur[i] ^= 1)) * e->size;
+		if (keep)
+			plotpoints(f, e->c.side, m);
+		m->npts = 0;
+		return;
+	}
+
+	compose(m, m->plane);
+	if (keep) {
+		f = e->frame + (i * 2 + (e->cur[i] ^= 1)) * e->size;
+		downsample(f, e->c.side, m);
+	}
+	fade(m, m->cycles);
+	m->plane ^= 1;
+}
+
+/* push the pooled frame and copy out the stack, oldest first */
+static void
+observe(Env *e, uint i, u8 *obs)
+{
+	u8 * s, *f;
+	uint k, n;
+
+	if (e->c.side == 0)
+		return;
+	n          = e->c.stack;
+	s          = e->stack + i * n * e->size;
+	f          = e->frame + i * 2 * e->size;
+	e->head[i] = (e->head[i] + 1) % n;
+	maxpool(s + e->head[i] * e->size, f, f + e->size, e->size);
+
+	obs += i * n * e->size;
+	for (k = 0; k < n; k++)
+		memcpy(obs + k * e->size, s + (e->head[i] + 1 + k) % n * e->size, e->size);
+}
+
+/* reset every machine and write the first observations, n x stack x side x side */
+void
+resetenv(Env *e, u8 *obs)
+{
+	uint i;
+
+	for (i = 0; i < e->c.n; i++) {
+		restart(e, i);
+		observe(e, i, obs);
+	}
+}
+
+/*
+ * Step every machine with its control word. obs is n x stack x side x
+ * side, reward and done have n entries.
+ */
+void
+stepenv(Env *e, const Word *ctl, u8 *obs, float *reward, u8 *done)
+{
+	Mach * m;
+	Event *ev;
+	uint   i, r, k;
+
+	for (i = 0; i < e->c.n; i++) {
+		m         = &e->m[i];
+		m->ctl    = ctl[i] & (017 | 0740000);
+		reward[i] = 0;
+		done[i]   = 0;
+		for (r = 0; r < e->c.repeat && !done[i]; r++) {
+			runframe(e, i, r + 2 >= e->c.repeat);
+
+			for (k = 0; k < m->nev; k++) {
+				ev = &m->ev[k];
+				if (ev->type == ESCORE)
+					reward[i] += (ev->player == 0) ? 1 : -1;
+				if (ev->type == ESCORE || ev->type == EROUND)
+					done[i] = 1;
+			}
+			m->nev = 0;
+			if (m->halt || (e->c.limit && m->nframe >= e->c.limit))
+				done[i] = 1;
+		}
+
+		if (done[i])
+			restart(e, i);
+		observe(e, i, obs);
+	}
+}
+
+/* the game state of every machine, n entries */
+void
+stateenv(Env *e, Game *g)
+{
+	uint i;
+
+	for (i = 0; i < e->c.n; i++)
+		readgame(&e->m[i], &g[i]);
+}
@@ -1,33 +1,106 @@
 #define nelem(x) (sizeof(x) / sizeof(x[0]))
 #define min(a, b) (((a) < (b)) ? (a) : (b))
+#define max(a, b) (((a) > (b)) ? (a) : (b))
 
 void loadrom(Mach *);
-void savestate(Mach *, void *);
-void loadstate(Mach *, void *);
-void initmach(Mach *, SDL_Renderer *, Config *);
+void setrom(Word *, Word);
+int  loadtape(const char *);
+size_t savestate(Mach *, void *);
+int    loadstate(Mach *, void *, size_t);
+void initmach(Mach *, Config *);
 void reset(Mach *);
 void step(Mach *);
+bool frameend(Mach *);
+void fade(Mach *, u64);
+void compose(Mach *, int);
 int  exec(Mach *, Word);
 Word memread(Mach *, Word);
 void memwrite(Mach *, Word, Word);
 void disasm(Inst *, Mach *, Word);
 
+void  clonemach(Mach *, Mach *);
+Fork *forkmach(Mach *);
+void  joinfork(Mach *, Fork *);
+void  freefork(Fork *);
+void  releasefork(Mach *);
+
+void inithist(Mach *, uint);
+void pushhist(Mach *);
+uint pophist(Mach *, uint);
+
 void *ecalloc(size_t, size_t);
+void *ereallocarray(void *, size_t, size_t);
+char *shmname(const char *);
+u32   checksum(const void *, size_t);
 void  fatal(const char *, ...);
 
 FILE *xfopen(const char *, const char *, ...);
 
 size_t put1(u8 *, u8);
+size_t put3(u8 *, u32);
 size_t put4(u8 *, u32);
+size_t putv(u8 *, u32);
 size_t putm(u8 *, u8 *, size_t);
 size_t get1(u8 *, u8 *);
+size_t get3(u8 *, u32 *);
 size_t get4(u8 *, u32 *);
+size_t getv(u8 *, u8 *, u32 *);
 size_t getm(u8 *, u8 *, size_t);
 
+u32  lookupinput(Controller *, s64);
+int  bindinput(Controller *, s64, int);
+void unbindinput(Controller *, int, bool);
+int  padnum(Controller *, s32);
+int  addpad(Controller *, int);
+void delpad(Controller *, s32);
+
 int loadconfig(Controller *, Config *, const char *);
 int saveconfig(Controller *, Config *, const char *);
-int loadstate_f(Mach *, uint);
-int savestate_f(Mach *, uint);
+void initslots(void);
+void syncslots(void);
+int  loadstate_f(Mach *, uint);
+int  savestate_f(Mach *, uint);
+
+int  recordmovie(Mach *, const char *);
+int  playmovie(Mach *, const char *);
+int  seekmovie(Mach *, u32);
+Word movieinput(Movie *, u32, Word);
+void movieframe(Movie *, Mach *);
+bool movieend(Mach *);
+int  closemovie(Mach *);
+
+int  opennet(Net **, int, int, const char *, int, uint, uint, uint);
+bool netframe(Net *, Mach *, Word);
+void netstats(Net *, u32 *, u32 *, u32 *);
+void closenet(Net *);
+
+int  openspec(const char *, Mach *);
+void putspec(Mach *);
+void closespec(void);
+int  watchspec(Spec **, const char *);
+int  readspec(Spec *, Tile **);
+void unwatchspec(Spec *);
+
+int  openshare(Mach **, const char *);
+void beginshare(void);
+void endshare(Mach *);
+void closeshare(void);
+
+int  openenv(Env **, Envconf *);
+void resetenv(Env *, u8 *);
+void stepenv(Env *, const Word *, u8 *, float *, u8 *);
+void closeenv(Env *);
+void stateenv(Env *, Game *);
+
+void readgame(Mach *, Game *);
+
+void downsample(u8 *, uint, Mach *);
+void plotpoints(u8 *, uint, Mach *);
+void maxpool(u8 *, const u8 *, const u8 *, size_t);
+
+int  openvideo(const char *, Mach *, double, bool);
+void putvideo(Mach *);
+void closevideo(void);
 
 void        setrootdir(const char *);
 const char *rootdir(void);
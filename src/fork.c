@@ -0,0 +1,152 @@
+#include "u.h"
+#include "libc.h"
+#include "dat.h"
+#include "fns.h"
+
+/*
+ * Machine cloning for search. clonemach() copies the live state of one
+ * machine into another. forkmach() captures a copy-on-write snapshot: each
+ * machine remembers the page it last forked from or joined to (its base)
+ * and which pages it has written since (stale), so pages that are still
+ * clean are shared with the fork instead of copied.
+ */
+
+void
+clonemach(Mach *dst, Mach *src)
+{
+	dst->ac   = src->ac;
+	dst->io   = src->io;
+	dst->pc   = src->pc;
+	dst->ov   = src->ov;
+	dst->halt = src->halt;
+	dst->ctl  = src->ctl;
+
+	dst->cycles    = src->cycles;
+	dst->framemark = src->framemark;
+	dst->nframe    = src->nframe;
+	memcpy(dst->flag, src->flag, sizeof(dst->flag));
+	memcpy(dst->sense, src->sense, sizeof(dst->sense));
+	memcpy(dst->mem, src->mem, sizeof(dst->mem));
+	memcpy(dst->written, src->written, sizeof(dst->written));
+	dst->dirty = dst->stale = ~(u64)0;
+}
+
+static Page *
+newpage(Word *w)
+{
+	Page *p;
+
+	p = ecalloc(1, sizeof(*p));
+	SDL_AtomicSet(&p->ref, 1);
+	memcpy(p->w, w, sizeof(p->w));
+	return p;
+}
+
+static Page *
+incref(Page *p)
+{
+	SDL_AtomicIncRef(&p->ref);
+	return p;
+}
+
+static void
+decref(Page *p)
+{
+	if (p && SDL_AtomicDecRef(&p->ref))
+		free(p);
+}
+
+static void
+setbase(Mach *m, uint i, Page *p)
+{
+	incref(p);
+	decref(m->base[i]);
+	m->base[i] = p;
+}
+
+Fork *
+forkmach(Mach *m)
+{
+	Fork *f;
+	uint  i;
+
+	f       = ecalloc(1, sizeof(*f));
+	f->ac   = m->ac;
+	f->io   = m->io;
+	f->pc   = m->pc;
+	f->ov   = m->ov;
+	f->halt = m->halt;
+	f->ctl  = m->ctl;
+
+	f->cycles    = m->cycles;
+	f->framemark = m->framemark;
+	f->nframe    = m->nframe;
+	memcpy(f->flag, m->flag, sizeof(f->flag));
+	memcpy(f->sense, m->sense, sizeof(f->sense));
+
+	for (i = 0; i < NPAGE; i++) {
+		if (!m->base[i] || (m->stale & ((u64)1 << i))) {
+			f->page[i] = newpage(&m->mem[i * PAGESIZE]);
+			setbase(m, i, f->page[i]);
+		} else
+			f->page[i] = incref(m->base[i]);
+	}
+	m->stale = 0;
+
+	return f;
+}
+
+void
+joinfork(Mach *m, Fork *f)
+{
+	uint i;
+
+	m->ac   = f->ac;
+	m->io   = f->io;
+	m->pc   = f->pc;
+	m->ov   = f->ov;
+	m->halt = f->halt;
+	m->ctl  = f->ctl;
+
+	m->cycles    = f->cycles;
+	m->framemark = f->framemark;
+	m->nframe    = f->nframe;
+	memcpy(m->flag, f->flag, sizeof(m->flag));
+	memcpy(m->sense, f->sense, sizeof(m->sense));
+
+	for (i = 0; i < NPAGE; i++) {
+		if (m->base[i] == f->page[i] && !(m->stale & ((u64)1 << i)))
+			continue;
+
+		memcpy(&m->mem[i * PAGESIZE], f->page[i]->w, sizeof(f->page[i]->w));
+		setbase(m, i, f->page[i]);
+		m->dirty |= (u64)1 << i;
+	}
+	m->stale = 0;
+}
+
+void
+freefork(Fork *f)
+{
+	uint i;
+
+	if (!f)
+		return;
+
+	for (i = 0; i < NPAGE; i++)
+		decref(f->page[i]);
+	free(f);
+}
+
+/* drop the machine's references to its base pages */
+void
+releasefork(Mach *m)
+{
+	uint i;
+
+	for (i = 0; i < NPAGE; i++) {
+		decref(m->base[i]);
+		m->base[i] = NULL;
+	}
+	m->stale = ~(u64)0;
+}
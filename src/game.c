@@ -0,0 +1,93 @@
+#include "u.h"
+#include "libc.h"
+#include "dat.h"
+#include "fns.h"
+
+/*
+ * Decode Spacewar's tables into a Game. Counters in the game count up
+ * from a negative start to zero, so what is left is their negation; the
+ * torpedo counter starts one below the number of torpedoes.
+ */
+static s32
+sword(Word w)
+{
+	w &= 0777777;
+	return (w & 0400000) ? -(s32)(~w & 0777777) : (s32)w;
+}
+
+static s16
+left(Word w)
+{
+	s32 n;
+
+	n = -sword(w);
+	return (n < 0) ? 0 : n;
+}
+
+static int
+kind(Word w)
+{
+	switch (w & 07777) {
+	case 0:
+		return ONONE;
+	case SS1:
+	case SS2:
+		return OSHIP;
+	case TCR:
+		return OTORP;
+	case MEX:
+		return OBLAST;
+	case HP1:
+	case HP3:
+		return OHYPER;
+	}
+	return ONONE;
+}
+
+void
+readgame(Mach *m, Game *g)
+{
+	Object *o;
+	Ship *  s;
+	Word *  mem;
+	int     i, k;
+
+	mem         = m->mem;
+	g->frame    = m->nframe;
+	g->score[0] = mem[SC1];
+	g->score[1] = mem[SC2];
+	g->nobj     = 0;
+	g->pad      = 0;
+	for (i = 0; i < NOBJ; i++) {
+		o       = &g->obj[i];
+		o->kind = kind(mem[MTB + i]);
+		o->pad  = 0;
+		o->life = left(mem[NA1 + i]);
+		o->x    = sword(mem[NX1 + i]);
+		o->y    = sword(mem[NY1 + i]);
+		o->dx   = sword(mem[NDX + i]);
+		o->dy   = sword(mem[NDY + i]);
+		if (o->kind != ONONE)
+			g->nobj++;
+	}
+
+	for (i = 0; i < 2; i++) {
+		s           = &g->ship[i];
+		k           = g->obj[i].kind;
+		s->alive    = k == OSHIP || k == OHYPER;
+		s->hyper    = k == OHYPER;
+		s->torps    = left(mem[NTR + i]);
+		s->torps    = (s->torps > 0) ? s->torps - 1 : 0;
+		s->jumps    = left(mem[NH2 + i]);
+		s->recharge = left(mem[NH3 + i]);
+		s->x        = g->obj[i].x;
+		s->y        = g->obj[i].y;
+		s->dx       = g->obj[i].dx;
+		s->dy       = g->obj[i].dy;
+		s->angle    = sword(mem[NTH + i]);
+		s->spin     = sword(mem[NOM + i]);
+		s->fuel     = -sword(mem[NFU + i]);
+		if (s->fuel < 0)
+			s->fuel = 0;
+	}
+}
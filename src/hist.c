@@ -0,0 +1,168 @@
+#include "u.h"
+#include "libc.h"
+#include "dat.h"
+#include "fns.h"
+
+/*
+ * In-memory rewind. pushhist() is called at every frame boundary; it saves
+ * the pages dirtied since the previous boundary as they were at that
+ * boundary (kept in the shadow copy), then opens a new frame with the
+ * current registers. pophist() undoes pages newest first, so rewinding
+ * costs a copy of only the pages that changed.
+ */
+
+void
+inithist(Mach *m, uint nframe)
+{
+	Hist *h;
+
+	h         = ecalloc(1, sizeof(*h));
+	h->nframe = nframe;
+	h->frame  = ecalloc(nframe, sizeof(*h->frame));
+	h->npage  = max(nframe * 16, NPAGE);
+	h->page   = ecalloc(h->npage, sizeof(*h->page));
+
+	m->hist  = h;
+	m->dirty = ~(u64)0;
+}
+
+static void
+dropoldest(Hist *h)
+{
+	Histframe *f;
+	uint       i;
+
+	f = &h->frame[(h->fhead + h->nframe - h->fcount) % h->nframe];
+	for (i = 0; i < NPAGE; i++) {
+		if (f->pages & ((u64)1 << i))
+			h->pcount--;
+	}
+	h->fcount--;
+}
+
+void
+pushhist(Mach *m)
+{
+	Histframe *f;
+	Hist *     h;
+	uint       i, n;
+
+	h = m->hist;
+	if (!h)
+		return;
+
+	if (h->fcount == 0)
+		memcpy(h->shadow, m->mem, sizeof(h->shadow));
+	else {
+		f = &h->frame[(h->fhead + h->nframe - 1) % h->nframe];
+		for (i = n = 0; i < NPAGE; i++)
+			n += (m->dirty >> i) & 1;
+		while (h->pcount + n > h->npage && h->fcount > 1)
+			dropoldest(h);
+
+		f->page  = h->phead;
+		f->pages = m->dirty;
+		for (i = 0; i < NPAGE; i++) {
+			if (!(m->dirty & ((u64)1 << i)))
+				continue;
+
+			memcpy(h->page[h->phead], &h->shadow[i * PAGESIZE], sizeof(*h->page));
+			memcpy(&h->shadow[i * PAGESIZE], &m->mem[i * PAGESIZE], sizeof(*h->page));
+			h->phead = (h->phead + 1) % h->npage;
+			h->pcount++;
+		}
+	}
+	m->dirty = 0;
+
+	if (h->fcount == h->nframe)
+		dropoldest(h);
+
+	f = &h->frame[h->fhead];
+	memset(f, 0, sizeof(*f));
+	f->ac        = m->ac;
+	f->io        = m->io;
+	f->pc        = m->pc;
+	f->ov        = m->ov;
+	f->halt      = m->halt;
+	f->cycles    = m->cycles;
+	f->framemark = m->framemark;
+	f->frame     = m->nframe;
+	memcpy(f->flag, m->flag, sizeof(f->flag));
+	memcpy(f->sense, m->sense, sizeof(f->sense));
+	memcpy(f->written, m->written, sizeof(f->written));
+
+	h->fhead = (h->fhead + 1) % h->nframe;
+	h->fcount++;
+}
+
+static void
+restorepages(Mach *m, Word (*page)[PAGESIZE], uint npage, uint first, u64 pages)
+{
+	Hist *h;
+	uint  i, p;
+
+	h = m->hist;
+	for (i = 0, p = first; i < NPAGE; i++) {
+		if (!(pages & ((u64)1 << i)))
+			continue;
+
+		memcpy(&m->mem[i * PAGESIZE], page[p], sizeof(*page));
+		memcpy(&h->shadow[i * PAGESIZE], page[p], sizeof(*page));
+		p = (p + 1) % npage;
+	}
+	m->stale |= pages;
+}
+
+/*
+ * Go back to the frame boundary n frames before the newest one; n = 0
+ * discards the work done since the last boundary. Returns how many frames
+ * were actually rewound, which is limited by the history kept.
+ */
+uint
+pophist(Mach *m, uint n)
+{
+	Histframe *f;
+	Hist *     h;
+	uint       i, k;
+
+	h = m->hist;
+	if (!h || h->fcount == 0)
+		return 0;
+	if (n >= h->fcount)
+		n = h->fcount - 1;
+
+	for (i = 0; i < NPAGE; i++) {
+		if (m->dirty & ((u64)1 << i))
+			memcpy(&m->mem[i * PAGESIZE], &h->shadow[i * PAGESIZE], sizeof(*h->page));
+	}
+
+	for (k = 0; k < n; k++) {
+		h->fhead = (h->fhead + h->nframe - 1) % h->nframe;
+		h->fcount--;
+
+		f = &h->frame[(h->fhead + h->nframe - 1) % h->nframe];
+		for (i = 0; i < NPAGE; i++) {
+			if (f->pages & ((u64)1 << i))
+				h->pcount--;
+		}
+		h->phead = f->page;
+		restorepages(m, h->page, h->npage, f->page, f->pages);
+		f->pages = 0;
+	}
+
+	f     = &h->frame[(h->fhead + h->nframe - 1) % h->nframe];
+	m->ac = f->ac;
+	m->io = f->io;
+	m->pc = f->pc;
+	m->ov = f->ov;
+	memcpy(m->flag, f->flag, sizeof(m->flag));
+	memcpy(m->sense, f->sense, sizeof(m->sense));
+	memcpy(m->written, f->written, sizeof(m->written));
+	m->halt      = f->halt;
+	m->cycles    = f->cycles;
+	m->framemark = f->framemark;
+	m->nframe    = f->frame;
+	m->dirty     = 0;
+
+	return n;
+}
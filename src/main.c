@@ -3,23 +3,144 @@
 #include "dat.h"
 #include "fns.h"
 
-Mach mach;
+Mach *mach;
 
 SDL_Window *window;
 
-SDL_Renderer *renderer;
-
 Controller ctl;
 
 Config conf;
 
+char *video;
+
+/* status output, kept off stdout when the video goes there */
+FILE *msg;
+
+char *tape;
+
+char *framepc;
+
+char *record;
+
+char *play;
+
+char *seekto;
+
+char *rounds;
+
+char *netarg;
+
+char *broadcast;
+
+char *watch;
+
+char *share;
+
+Net *net;
+
+/*
+ * The main thread handles input and presents frames. Presents never wait
+ * for the display, so events are handled every millisecond or so rather
+ * than once per refresh. The control word is published through an atomic
+ * that the guest samples on every IOT 011; other actions are posted as
+ * bits for the emulator thread to pick up between batches.
+ */
+enum {
+	CSAVE  = 1 << 0,
+	CLOAD  = 1 << 1,
+	CNEXT  = 1 << 2,
+	CPREV  = 1 << 3,
+	CRESET = 1 << 4,
+	CPAUSE = 1 << 5,
+	CQUIT  = 1 << 6,
+};
+
+static struct {
+	SDL_Thread * thread;
+	SDL_atomic_t ctl;
+	SDL_atomic_t cmd;
+	SDL_atomic_t fast;
+	SDL_atomic_t rewind;
+	Word         word;
+} in;
+
+/*
+ * The CPU plots into one hit plane while the compositor thread merges the
+ * other into the intensity plane, converts it and fades it.
+ */
+static struct {
+	SDL_Thread *thread;
+	SDL_mutex * lock;
+	SDL_cond *  cond;
+
+	bool busy;
+	bool show;
+	int  plane;
+	u64  time;
+} comp;
+
+/*
+ * Converted frames are passed from the compositor to the main thread,
+ * which owns the window and renderer, through a triple buffer. The
+ * producer and consumer each own one buffer and swap it with the middle
+ * one atomically, so neither ever waits on the other.
+ *
+ * Each buffer carries the compose generation it holds and a copy of the
+ * per-row generations, so only rows that changed since the buffer (or the
+ * texture) was last filled need converting (or uploading).
+ */
+enum {
+	FRESH = 0x4,
+};
+
+typedef struct {
+	u32 gen;
+	u32 rowgen[512];
+	u32 pix[512 * 512];
+} Frame;
+
+static struct {
+	SDL_Renderer *re;
+	SDL_Texture * tex;
+	SDL_atomic_t  mid;
+	int           back;
+	int           front;
+	u32           gen;
+	u32           shown;
+	u32           period;
+
+	Frame frame[3];
+} mbox;
+
 static void
 usage(void)
 {
 	fprintf(stderr, "usage: [options]\n\n");
+	fprintf(stderr, "-b <name>\n");
+	fprintf(stderr, "    show the display to local spectators through shared memory name\n");
 	fprintf(stderr, "-d <spacewar_dir>\n");
 	fprintf(stderr, "    location to load/save spacewars data\n");
 	fprintf(stderr, "-h  show this help message\n");
+	fprintf(stderr, "-P <movie>\n");
+	fprintf(stderr, "    play an input movie headless at full speed and check that it matches\n");
+	fprintf(stderr, "-n <player>:<port>:<host>:<port>\n");
+	fprintf(stderr, "    netplay as player 1 or 2 from a local UDP port to a peer\n");
+	fprintf(stderr, "-p <octal>\n");
+	fprintf(stderr, "    address that marks the end of a frame, none to time frames by cycles\n");
+	fprintf(stderr, "-s <name>\n");
+	fprintf(stderr, "    keep the machine in shared memory name for other programs to read\n");
+	fprintf(stderr, "-S <frame>\n");
+	fprintf(stderr, "    with -P, seek to a frame before playing the rest\n");
+	fprintf(stderr, "-R <rounds>\n");
+	fprintf(stderr, "    with -P, stop on the frame the given number of rounds are decided\n");
+	fprintf(stderr, "-r <movie>\n");
+	fprintf(stderr, "    record an input movie from reset; reset, load and rewind are disabled\n");
+	fprintf(stderr, "-t <tape>\n");
+	fprintf(stderr, "    run a RIM/BIN paper tape image instead of spacewar\n");
+	fprintf(stderr, "-w <name>\n");
+	fprintf(stderr, "    watch the display another instance shows through shared memory name\n");
+	fprintf(stderr, "-y <file>\n");
+	fprintf(stderr, "    record the display to a y4m (or .raw grayscale) file, - for stdout\n");
 	exit(2);
 }
 
@@ -29,7 +150,8 @@ parseargs(int argc, char *argv[])
 	char *dir;
 	int   i, args;
 
-	dir = NULL;
+	dir   = NULL;
+	video = NULL;
 	while (argc > 1) {
 		if (argv[1][0] != '-')
 			break;
@@ -37,18 +159,84 @@ parseargs(int argc, char *argv[])
 		args = 1;
 		for (i = 1; argv[1][i] != '\0'; i++) {
 			switch (argv[1][i]) {
+			case 'b':
+				if (!argv[2])
+					usage();
+				broadcast = argv[2];
+				break;
+
 			case 'd':
 				if (!argv[2])
 					usage();
 				dir = argv[2];
 				break;
 
+			case 'n':
+				if (!argv[2])
+					usage();
+				netarg = argv[2];
+				break;
+
+			case 'p':
+				if (!argv[2])
+					usage();
+				framepc = argv[2];
+				break;
+
+			case 'P':
+				if (!argv[2])
+					usage();
+				play = argv[2];
+				break;
+
+			case 'R':
+				if (!argv[2])
+					usage();
+				rounds = argv[2];
+				break;
+
+			case 'S':
+				if (!argv[2])
+					usage();
+				seekto = argv[2];
+				break;
+
+			case 'r':
+				if (!argv[2])
+					usage();
+				record = argv[2];
+				break;
+
+			case 's':
+				if (!argv[2])
+					usage();
+				share = argv[2];
+				break;
+
+			case 't':
+				if (!argv[2])
+					usage();
+				tape = argv[2];
+				break;
+
+			case 'y':
+				if (!argv[2])
+					usage();
+				video = argv[2];
+				break;
+
+			case 'w':
+				if (!argv[2])
+					usage();
+				watch = argv[2];
+				break;
+
 			case 'h':
 			default:
 				usage();
 			}
 
-			if (argv[1][i] == 'd') {
+			if (strchr("bdnPpRrSstwy", argv[1][i])) {
 				args++;
 				break;
 			}
@@ -58,182 +246,484 @@ parseargs(int argc, char *argv[])
 		argv += args;
 	}
 
+	msg = (video && !strcmp(video, "-")) ? stderr : stdout;
 	setrootdir(dir);
 	loadconfig(&ctl, &conf, "config");
 	saveconfig(&ctl, &conf, "config");
 }
 
 static void
-remapctl(void)
-{
-	int i, n;
-
-	for (i = 0; i < ctl.nctx; i++)
-		SDL_GameControllerClose(ctl.ctx[i]);
-	free(ctl.ctx);
-
-	n        = SDL_NumJoysticks();
-	ctl.ctx  = ecalloc(n, sizeof(*ctl.ctx));
-	ctl.nctx = 0;
-	for (i = 0; i < n; i++) {
-		if (SDL_IsGameController(i)) {
-			ctl.ctx[i] = SDL_GameControllerOpen(i);
-			if (!ctl.ctx[i])
-				fprintf(stderr, "Failed to open controller %d: %s\n", i + 1, SDL_GetError());
-			else
-				ctl.nctx++;
-		}
-	}
+plugpad(int i)
+{
+	int ret;
+
+	if ((ret = addpad(&ctl, i)) < 0)
+		fprintf(stderr, "Failed to open controller %d: %s\n", i + 1,
+		        (ret == -ENODEV) ? SDL_GetError() : strerror(-ret));
 }
 
 static void
 initsdl(void)
 {
+	int i;
+
 	SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "best");
-	SDL_SetHint(SDL_HINT_RENDER_VSYNC, "1");
 
 	if (SDL_Init(SDL_INIT_EVERYTHING & ~SDL_INIT_AUDIO) < 0)
 		fatal("Failed to init SDL: %s", SDL_GetError());
 
-	if (SDL_CreateWindowAndRenderer(512, 512, SDL_WINDOW_RESIZABLE, &window, &renderer) < 0)
+	window = SDL_CreateWindow("Spacewar", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+	                          512, 512, SDL_WINDOW_RESIZABLE);
+	if (!window)
 		fatal("Failed to create SDL window: %s", SDL_GetError());
 
-	SDL_SetWindowTitle(window, "Spacewar");
-	SDL_RenderSetLogicalSize(renderer, 512, 512);
+	for (i = 0; i < SDL_NumJoysticks(); i++) {
+		if (SDL_IsGameController(i))
+			plugpad(i);
+	}
+}
+
+static void
+post(int cmd)
+{
+	int v;
+
+	do
+		v = SDL_AtomicGet(&in.cmd);
+	while (!SDL_AtomicCAS(&in.cmd, v, v | cmd));
+}
 
-	SDL_RenderClear(renderer);
-	SDL_RenderPresent(renderer);
+/* let the emulator finish its batch so that exit handlers see a still machine */
+static void
+quit(void)
+{
+	u32 confirmed, rollbacks, resims;
 
-	remapctl();
+	post(CQUIT);
+	SDL_WaitThread(in.thread, NULL);
+	if (net) {
+		netstats(net, &confirmed, &rollbacks, &resims);
+		fprintf(msg, "netplay: %u frames confirmed, %u rollbacks, %u frames resimulated\n",
+		        confirmed, rollbacks, resims);
+		closenet(net);
+		net = NULL;
+	}
+	exit(0);
 }
 
 static void
-input(Mach *m, s64 *map, s64 button, bool clear)
+action(int act, bool clear)
 {
 	static Word bits[] = {
 	    0000001, 0000002, 0000004, 0000010,
 	    0040000, 0100000, 0200000, 0400000,
 	};
-	size_t i;
-
-	for (i = 0; i <= B2L; i++) {
-		if (map[i] == button) {
-			if (clear)
-				m->ctl &= ~bits[i];
-			else
-				m->ctl |= bits[i];
-		}
+
+	if (act <= B2L) {
+		if (clear)
+			in.word &= ~bits[act];
+		else
+			in.word |= bits[act];
+		SDL_AtomicSet(&in.ctl, in.word);
+		return;
 	}
 
 	if (!clear) {
-		if (map[BST] == button)
-			savestate_f(m, m->statepos);
-		else if (map[BLT] == button)
-			loadstate_f(m, m->statepos);
-		else if (map[BIS] == button) {
-			if (++m->statepos >= nelem(m->state))
-				m->statepos = 0;
-		} else if (map[BDS] == button) {
-			if (m->statepos == 0)
-				m->statepos = nelem(m->state) - 1;
-			else
-				m->statepos--;
-		} else if (map[BRS] == button)
-			reset(m);
-		else if (map[BPU] == button)
-			m->halt ^= 0x2;
-		else if (map[BES] == button)
-			exit(0);
-		else if (map[BFS] == button)
-			conf.frameskip = 8;
+		if (act == BST)
+			post(CSAVE);
+		else if (act == BLT)
+			post(CLOAD);
+		else if (act == BIS)
+			post(CNEXT);
+		else if (act == BDS)
+			post(CPREV);
+		else if (act == BRS)
+			post(CRESET);
+		else if (act == BPU)
+			post(CPAUSE);
+		else if (act == BES)
+			quit();
+		else if (act == BFS)
+			SDL_AtomicSet(&in.fast, 1);
+		else if (act == BRW)
+			SDL_AtomicSet(&in.rewind, 1);
 	} else {
-		if (map[BFS] == button)
-			conf.frameskip = 1;
+		if (act == BFS)
+			SDL_AtomicSet(&in.fast, 0);
+		else if (act == BRW)
+			SDL_AtomicSet(&in.rewind, 0);
 	}
 }
 
-static s64
-j2d(int which)
+/*
+ * An action stays pressed while any of the inputs bound to it is down, so
+ * it fires on the first press and releases with the last release.
+ */
+static void
+input(s64 src, bool clear)
 {
-	SDL_GameController *c;
-	int                 i;
+	u32 act;
+	int i;
 
-	c = SDL_GameControllerFromInstanceID(which);
-	if (!c)
-		return -1;
+	act = lookupinput(&ctl, src);
+	for (i = 0; act; i++, act >>= 1) {
+		if (!(act & 1))
+			continue;
+		if (clear) {
+			if (ctl.held[i] == 0 || --ctl.held[i] > 0)
+				continue;
+		} else if (ctl.held[i]++ > 0)
+			continue;
+		action(i, clear);
+	}
+}
+
+/* run the actions posted by the input thread, false to quit */
+static bool
+command(Mach *m)
+{
+	int cmd;
 
-	for (i = 0; i < ctl.nctx; i++) {
-		if (ctl.ctx[i] == c)
-			return i;
+	cmd = SDL_AtomicSet(&in.cmd, 0);
+	if (m->movie)
+		cmd &= ~(CLOAD | CRESET);
+	if (net)
+		cmd &= ~(CLOAD | CRESET | CPAUSE);
+	if (share && (cmd & (CLOAD | CRESET | CPAUSE)))
+		beginshare();
+	if (cmd & CSAVE)
+		savestate_f(m, m->statepos);
+	if (cmd & CLOAD)
+		loadstate_f(m, m->statepos);
+	if (cmd & CNEXT) {
+		if (++m->statepos >= NSLOT)
+			m->statepos = 0;
 	}
-	return -1;
+	if (cmd & CPREV) {
+		if (m->statepos == 0)
+			m->statepos = NSLOT - 1;
+		else
+			m->statepos--;
+	}
+	if (cmd & CRESET)
+		reset(m);
+	if (cmd & CPAUSE)
+		m->halt ^= 0x2;
+	return !(cmd & CQUIT);
 }
 
 static void
-event(void)
+axis(SDL_ControllerAxisEvent *ev)
 {
-	SDL_Event ev;
+	bool down;
+	int  n;
 
-	while (SDL_PollEvent(&ev)) {
-		switch (ev.type) {
-		case SDL_QUIT:
-			exit(0);
+	n = padnum(&ctl, ev->which);
+	if (n < 0 || ev->axis >= SDL_CONTROLLER_AXIS_MAX)
+		return;
 
-		case SDL_KEYDOWN:
-			input(&mach, ctl.key, ev.key.keysym.sym, false);
-			break;
+	down = abs(ev->value) >= ctl.axis_threshold;
+	if (down != ctl.axisdown[n][ev->axis]) {
+		ctl.axisdown[n][ev->axis] = down;
+		input(INPUT(IAXIS, n, ev->axis), !down);
+	}
+}
 
-		case SDL_KEYUP:
-			input(&mach, ctl.key, ev.key.keysym.sym, true);
-			break;
+static void
+button(SDL_ControllerButtonEvent *ev, bool clear)
+{
+	int n;
 
-		case SDL_CONTROLLERAXISMOTION:
-			input(&mach, ctl.button, ev.caxis.axis | (j2d(ev.caxis.which) << 16),
-			      abs(ev.caxis.value) >= ctl.axis_threshold);
-			break;
+	n = padnum(&ctl, ev->which);
+	if (n < 0 || ev->button >= SDL_CONTROLLER_BUTTON_MAX)
+		return;
 
-		case SDL_CONTROLLERBUTTONDOWN:
-			input(&mach, ctl.button, ev.cbutton.button | (j2d(ev.cbutton.which) << 16), false);
-			break;
+	if (ctl.buttondown[n][ev->button] != !clear) {
+		ctl.buttondown[n][ev->button] = !clear;
+		input(INPUT(IBUTTON, n, ev->button), clear);
+	}
+}
 
-		case SDL_CONTROLLERBUTTONUP:
-			input(&mach, ctl.button, ev.cbutton.button | (j2d(ev.cbutton.which) << 16), true);
-			break;
+/* release whatever a pad holds down before it goes */
+static void
+unplug(s32 id)
+{
+	int n, i;
 
-		case SDL_CONTROLLERDEVICEADDED:
-			remapctl();
-			break;
+	n = padnum(&ctl, id);
+	if (n < 0)
+		return;
+
+	for (i = 0; i < SDL_CONTROLLER_BUTTON_MAX; i++) {
+		if (ctl.buttondown[n][i]) {
+			ctl.buttondown[n][i] = 0;
+			input(INPUT(IBUTTON, n, i), true);
+		}
+	}
+	for (i = 0; i < SDL_CONTROLLER_AXIS_MAX; i++) {
+		if (ctl.axisdown[n][i]) {
+			ctl.axisdown[n][i] = 0;
+			input(INPUT(IAXIS, n, i), true);
 		}
 	}
+	delpad(&ctl, id);
 }
 
 static void
-flush(Mach *m)
+event(SDL_Event *ev)
 {
-	int   x, y, pitch;
-	void *frame;
-	u32 * pix;
+	switch (ev->type) {
+	case SDL_QUIT:
+		quit();
+		break;
+
+	case SDL_KEYDOWN:
+		if (!ev->key.repeat)
+			input(INPUT(IKEY, 0, ev->key.keysym.sym), false);
+		break;
+
+	case SDL_KEYUP:
+		input(INPUT(IKEY, 0, ev->key.keysym.sym), true);
+		break;
+
+	case SDL_CONTROLLERAXISMOTION:
+		axis(&ev->caxis);
+		break;
+
+	case SDL_CONTROLLERBUTTONDOWN:
+		button(&ev->cbutton, false);
+		break;
+
+	case SDL_CONTROLLERBUTTONUP:
+		button(&ev->cbutton, true);
+		break;
+
+	case SDL_CONTROLLERDEVICEADDED:
+		plugpad(ev->cdevice.which);
+		break;
+
+	case SDL_CONTROLLERDEVICEREMOVED:
+		unplug(ev->cdevice.which);
+		break;
+	}
+}
+
+static void
+convert(Mach *m, Frame *f)
+{
+	u32 *pix;
+	int  x, y;
 
-	SDL_LockTexture(m->tex, NULL, &frame, &pitch);
-	pix = frame;
 	for (y = 0; y < m->dy; y++) {
-		for (x = 0; x < m->dx; x++) {
+		if (m->rowgen[y] <= f->gen)
+			continue;
+
+		pix = f->pix + y * m->dx;
+		for (x = 0; x < m->dx; x++)
 			pix[x] = m->cmap[m->pix[y][x]];
-			m->pix[y][x] >>= 1;
+	}
+	f->gen = m->gen;
+	memcpy(f->rowgen, m->rowgen, sizeof(f->rowgen));
+}
+
+static int
+compositor(void *arg)
+{
+	Mach *m;
+	bool  show;
+	int   plane;
+	u64   time;
+
+	m = arg;
+	for (;;) {
+		SDL_LockMutex(comp.lock);
+		while (!comp.busy)
+			SDL_CondWait(comp.cond, comp.lock);
+		plane = comp.plane;
+		time  = comp.time;
+		show  = comp.show;
+		SDL_UnlockMutex(comp.lock);
+
+		compose(m, plane);
+		if (show && video)
+			putvideo(m);
+		if (show && broadcast)
+			putspec(m);
+		if (show) {
+			convert(m, &mbox.frame[mbox.back]);
+			SDL_MemoryBarrierRelease();
+			mbox.back = SDL_AtomicSet(&mbox.mid, mbox.back | FRESH) & ~FRESH;
+		}
+		fade(m, time);
+
+		SDL_LockMutex(comp.lock);
+		comp.busy = false;
+		SDL_CondBroadcast(comp.cond);
+		SDL_UnlockMutex(comp.lock);
+	}
+	return 0;
+}
+
+static void
+initcomp(Mach *m)
+{
+	comp.lock = SDL_CreateMutex();
+	comp.cond = SDL_CreateCond();
+	if (!comp.lock || !comp.cond)
+		fatal("Failed to create compositor lock: %s", SDL_GetError());
+
+	comp.thread = SDL_CreateThread(compositor, "compositor", m);
+	if (!comp.thread)
+		fatal("Failed to create compositor thread: %s", SDL_GetError());
+}
+
+static void
+settle(void)
+{
+	SDL_LockMutex(comp.lock);
+	while (comp.busy)
+		SDL_CondWait(comp.cond, comp.lock);
+	SDL_UnlockMutex(comp.lock);
+}
+
+static void
+flush(Mach *m, bool show)
+{
+	SDL_LockMutex(comp.lock);
+	while (comp.busy)
+		SDL_CondWait(comp.cond, comp.lock);
+	comp.plane = m->plane;
+	comp.time  = m->cycles;
+	comp.show  = show;
+	comp.busy  = true;
+	SDL_CondBroadcast(comp.cond);
+	SDL_UnlockMutex(comp.lock);
+
+	m->plane ^= 1;
+}
+
+/*
+ * Upload the rows of a frame that changed after generation gen. Runs
+ * separated by only a few clean rows are merged into one update.
+ */
+static void
+upload(SDL_Texture *tex, Frame *f, u32 gen, int dx, int dy)
+{
+	SDL_Rect r;
+	int      y, last;
+
+	for (y = 0; y < dy;) {
+		if (f->rowgen[y] <= gen) {
+			y++;
+			continue;
 		}
-		pix += pitch / 4;
+
+		r.x = 0;
+		r.y = y;
+		r.w = dx;
+		for (last = y; y < dy && y - last <= 8; y++) {
+			if (f->rowgen[y] > gen)
+				last = y;
+		}
+		r.h = last + 1 - r.y;
+		SDL_UpdateTexture(tex, &r, f->pix + r.y * dx, dx * sizeof(*f->pix));
+	}
+}
+
+/*
+ * Show the latest frame if there is a new one, or now and then to repaint,
+ * but never more than once per display refresh. The renderer does not wait
+ * for vsync, so a present never holds up the events behind it.
+ */
+static void
+present(Mach *m)
+{
+	if (SDL_GetTicks() - mbox.shown < mbox.period)
+		return;
+	if (SDL_AtomicGet(&mbox.mid) & FRESH) {
+		mbox.front = SDL_AtomicSet(&mbox.mid, mbox.front) & ~FRESH;
+		upload(mbox.tex, &mbox.frame[mbox.front], mbox.gen, m->dx, m->dy);
+		mbox.gen = mbox.frame[mbox.front].gen;
+	} else if (SDL_GetTicks() - mbox.shown < 100)
+		return;
+
+	SDL_SetRenderDrawColor(mbox.re, 0, 0, 0, 0);
+	SDL_RenderClear(mbox.re);
+	SDL_RenderCopy(mbox.re, mbox.tex, NULL, NULL);
+	SDL_RenderPresent(mbox.re);
+	mbox.shown = SDL_GetTicks();
+}
+
+static void
+initpresent(Mach *m)
+{
+	SDL_DisplayMode mode;
+	size_t          i, j;
+
+	for (i = 0; i < nelem(mbox.frame); i++) {
+		for (j = 0; j < nelem(mbox.frame[i].pix); j++)
+			mbox.frame[i].pix[j] = m->cmap[0];
 	}
-	SDL_UnlockTexture(m->tex);
+	mbox.back  = 0;
+	mbox.front = 2;
+	mbox.gen   = 0;
+	SDL_AtomicSet(&mbox.mid, 1);
+
+	mbox.re = SDL_CreateRenderer(window, -1, 0);
+	if (!mbox.re)
+		fatal("Failed to create SDL renderer: %s", SDL_GetError());
+	SDL_RenderSetLogicalSize(mbox.re, m->dx, m->dy);
+
+	mbox.tex = SDL_CreateTexture(mbox.re, SDL_PIXELFORMAT_ABGR8888, SDL_TEXTUREACCESS_STREAMING, m->dx,
+	                             m->dy);
+	if (!mbox.tex)
+		fatal("Failed to create texture for display: %s", SDL_GetError());
+	SDL_UpdateTexture(mbox.tex, NULL, mbox.frame[mbox.front].pix,
+	                  m->dx * sizeof(*mbox.frame[mbox.front].pix));
+	mbox.period = 1000 / 60;
+	if (SDL_GetCurrentDisplayMode(SDL_GetWindowDisplayIndex(window), &mode) == 0 &&
+	    mode.refresh_rate > 0)
+		mbox.period = 1000 / mode.refresh_rate;
+	mbox.shown = SDL_GetTicks() - 100;
 }
 
+/*
+ * Show the frame n frames ahead of the machine, run with the input as it
+ * is now, then put the machine back. Only the last frame ahead is plotted,
+ * the machine itself never plots, so the display is the usual stream of
+ * frames shifted n frames into the future.
+ */
 static void
-draw(void)
+runahead(Mach *m, uint n)
 {
-	SDL_SetRenderDrawColor(renderer, 0, 0, 0, 0);
-	SDL_RenderClear(renderer);
+	Movie *mv;
+	Fork * f;
+
+	mv       = m->movie;
+	m->movie = NULL;
+	f        = forkmach(m);
+	while (n > 0 && !m->halt) {
+		m->nodraw = n > 1;
+		step(m);
+		if (frameend(m))
+			n--;
+	}
+	flush(m, true);
+	joinfork(m, f);
+	freefork(f);
+	m->nodraw = true;
+	m->movie  = mv;
+}
 
-	SDL_RenderCopy(renderer, mach.tex, NULL, NULL);
-	SDL_RenderPresent(renderer);
+/* wait at a frame boundary until netplay lets the next frame run */
+static void
+netwait(Mach *m)
+{
+	while (!netframe(net, m, SDL_AtomicGet(&in.ctl))) {
+		if (SDL_AtomicGet(&in.cmd) & CQUIT)
+			break;
+		SDL_Delay(1);
+	}
 }
 
 static void
@@ -243,15 +733,37 @@ emulate(Mach *m)
 	double speed;
 
 	t        = SDL_GetTicks();
-	speed    = conf.fps * conf.frameskip;
+	speed    = conf.fps * (SDL_AtomicGet(&in.fast) ? 8 : conf.frameskip);
 	frame    = 0;
 	maxframe = 1 + ceil((t - m->frametime) / (1000.0 / speed));
+
+	/* step back two frame boundaries and replay one to show it */
+	if (SDL_AtomicGet(&in.rewind) && !m->movie && !(m->halt & 0x2)) {
+		if (share)
+			beginshare();
+		maxframe = (pophist(m, 2) == 2);
+	}
+
+	m->nodraw = conf.runahead > 0;
 	for (;;) {
 		if (frame < maxframe) {
+			/* a halted machine does not change, so readers need not wait */
+			if (share && !m->halt)
+				beginshare();
 			step(m);
-			if (m->pc == 02051 && !m->halt) {
-				flush(m);
+			if (frameend(m)) {
 				frame++;
+				pushhist(m);
+				if (net)
+					netwait(m);
+				if (!conf.runahead)
+					flush(m, frame >= maxframe);
+				else if (frame >= maxframe)
+					runahead(m, conf.runahead);
+				if (share) {
+					settle();
+					endshare(m);
+				}
 			}
 		}
 
@@ -260,29 +772,317 @@ emulate(Mach *m)
 		}
 	}
 
+	if (share) {
+		settle();
+		endshare(m);
+	}
 	m->frametime = SDL_GetTicks();
 }
 
 static void
-loop(void)
+endrecord(void)
 {
-	Mach *m;
+	int ret;
+
+	if ((ret = closemovie(mach)) < 0)
+		fprintf(stderr, "Failed to write movie %s: %s\n", record, strerror(-ret));
+}
+
+/* print the game events of the last frame, returns the number of rounds decided */
+static uint
+events(Mach *m)
+{
+	Event *e;
+	uint   i, n;
+
+	n = 0;
+	for (i = 0; i < m->nev; i++) {
+		e = &m->ev[i];
+		switch (e->type) {
+		case EDEATH:
+			fprintf(msg, "frame %u: player %d destroyed\n", e->frame, e->player + 1);
+			break;
+		case ESCORE:
+			fprintf(msg, "frame %u: player %d scores, %u\n", e->frame, e->player + 1, e->score);
+			n++;
+			break;
+		case EROUND:
+			if (i == 0 || m->ev[i - 1].type != ESCORE) {
+				fprintf(msg, "frame %u: draw\n", e->frame);
+				n++;
+			}
+			break;
+		}
+	}
+	m->nev = 0;
+	return n;
+}
 
-	m = &mach;
+/*
+ * Play a movie with no pacing, then check the result. Nothing is drawn
+ * unless the display is recorded, in which case the writer is waited for
+ * rather than frames dropped. With a round limit, stop as soon as the last
+ * round is decided instead, which leaves nothing to check.
+ */
+static void
+headless(Mach *m)
+{
+	Event  ev[NEVENT];
+	u64    t;
+	double secs;
+	u32    start;
+	uint   n, limit;
+	bool   stopped;
+	int    ret;
+
+	if ((ret = playmovie(m, play)) < 0)
+		fatal("Failed to load movie %s: %s", play, strerror(-ret));
+
+	m->nodraw = true;
+	if (seekto) {
+		t = SDL_GetPerformanceCounter();
+		if ((ret = seekmovie(m, strtoul(seekto, NULL, 0))) < 0)
+			fatal("Failed to seek movie %s to %s: %s", play, seekto, strerror(-ret));
+		secs = (double)(SDL_GetPerformanceCounter() - t) / SDL_GetPerformanceFrequency();
+		fprintf(msg, "seek to frame %u in %.3fs\n", m->nframe, secs);
+	}
+
+	if (video) {
+		if (openvideo(video, m, conf.fps, true) < 0)
+			fatal("Failed to open video output %s: %s", video, strerror(errno));
+		atexit(closevideo);
+		m->nodraw = false;
+	}
+
+	m->ev = ev;
+	n     = 0;
+	limit = rounds ? strtoul(rounds, NULL, 0) : 0;
+	start = m->nframe;
+	t     = SDL_GetPerformanceCounter();
+	while (!m->halt && !movieend(m)) {
+		step(m);
+		if (!frameend(m))
+			continue;
+		if (video) {
+			compose(m, m->plane);
+			putvideo(m);
+			fade(m, m->cycles);
+			m->plane ^= 1;
+		}
+		if (m->nev > 0) {
+			n += events(m);
+			if (limit && n >= limit)
+				break;
+		}
+	}
+	secs = (double)(SDL_GetPerformanceCounter() - t) / SDL_GetPerformanceFrequency();
+
+	stopped = limit && n >= limit;
+	if (stopped)
+		fprintf(msg, "%u rounds decided by frame %u, score %u:%u, in %.3fs\n", n, m->nframe,
+		        m->mem[SC1], m->mem[SC2], secs);
+	else
+		fprintf(msg, "%u frames, %llu cycles, played %u frames in %.3fs, %.0f frames/s\n",
+		        m->nframe, (unsigned long long)m->cycles, m->nframe - start, secs,
+		        (m->nframe - start) / secs);
+
+	/* the end state can only be checked at the end */
+	ret = closemovie(m);
+	if (stopped)
+		fprintf(msg, "stopped before the end, not checked\n");
+	else
+		fprintf(msg, "%s\n", (ret < 0) ? "mismatch" : "match");
+	exit(!stopped && ret < 0);
+}
+
+/*
+ * Show what another instance broadcasts. Tiles are converted and uploaded
+ * as they are read, so the viewer never holds a frame of its own.
+ */
+static void
+spectate(Mach *m)
+{
+	SDL_Renderer *re;
+	SDL_Texture * tex;
+	SDL_Event     ev;
+	SDL_Rect      r, row;
+	Spec *        s;
+	Tile *        t;
+	u32           pix[TILE * TILE], clear[512];
+	int           ret, i, x, y;
+
+	if ((ret = watchspec(&s, watch)) < 0)
+		fatal("Failed to watch %s: %s", watch, strerror(-ret));
+
+	/* the viewer only looks for quit, so it can wait for vsync */
+	re = SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC);
+	if (!re)
+		fatal("Failed to create SDL renderer: %s", SDL_GetError());
+	SDL_RenderSetLogicalSize(re, m->dx, m->dy);
+
+	tex = SDL_CreateTexture(re, SDL_PIXELFORMAT_ABGR8888, SDL_TEXTUREACCESS_STREAMING, m->dx, m->dy);
+	if (!tex)
+		fatal("Failed to create texture for display: %s", SDL_GetError());
+	for (i = 0; i < m->dx; i++)
+		clear[i] = m->cmap[0];
+
+	r.w   = TILE;
+	r.h   = TILE;
+	row.x = 0;
+	row.w = m->dx;
+	row.h = 1;
 	for (;;) {
-		event();
+		while (SDL_PollEvent(&ev)) {
+			if (ev.type == SDL_QUIT)
+				exit(0);
+			if (ev.type == SDL_KEYDOWN && lookupinput(&ctl, INPUT(IKEY, 0, ev.key.keysym.sym)) & (1u << BES))
+				exit(0);
+		}
+
+		while ((ret = readspec(s, &t)) != 0) {
+			if (ret == SPECCLEAR) {
+				for (row.y = 0; row.y < m->dy; row.y++)
+					SDL_UpdateTexture(tex, &row, clear, sizeof(clear));
+				continue;
+			}
+
+			for (y = 0; y < TILE; y++) {
+				for (x = 0; x < TILE; x++)
+					pix[y * TILE + x] = m->cmap[t->pix[y][x]];
+			}
+			r.x = t->x * TILE;
+			r.y = t->y * TILE;
+			SDL_UpdateTexture(tex, &r, pix, TILE * sizeof(*pix));
+		}
+
+		SDL_SetRenderDrawColor(re, 0, 0, 0, 0);
+		SDL_RenderClear(re);
+		SDL_RenderCopy(re, tex, NULL, NULL);
+		SDL_RenderPresent(re);
+	}
+}
+
+static void
+opensession(const char *s)
+{
+	char host[64];
+	int  player, port, rport, ret;
+
+	if (sscanf(s, "%d:%d:%63[^:]:%d", &player, &port, host, &rport) != 4)
+		usage();
+	if ((ret = opennet(&net, player, port, host, rport, conf.netdelay, conf.netlag, conf.netloss)) < 0)
+		fatal("Failed to start netplay on %s: %s", s, strerror(-ret));
+}
+
+static void
+setframepc(Mach *m, const char *s)
+{
+	char *e;
+	long  a;
+
+	if (!strcmp(s, "none")) {
+		m->framepc = 010000;
+		return;
+	}
+	a = strtol(s, &e, 8);
+	if (*s == '\0' || *e != '\0' || a < 0 || a > 07777)
+		usage();
+	m->framepc = a;
+}
+
+static int
+emulator(void *arg)
+{
+	Mach *m;
+
+	m = arg;
+	if (net)
+		netwait(m);
+	while (command(m))
 		emulate(m);
-		draw();
+	return 0;
+}
+
+/*
+ * Input is polled and frames are presented on the main thread, as SDL
+ * requires. Presents do not wait for vsync, so events are still drained
+ * every millisecond or so whatever the display is doing.
+ */
+static void
+loop(void)
+{
+	SDL_Event ev;
+
+	if (!net)
+		mach->ctlsrc = &in.ctl;
+	in.thread = SDL_CreateThread(emulator, "emulator", mach);
+	if (!in.thread)
+		fatal("Failed to create emulator thread: %s", SDL_GetError());
+
+	for (;;) {
+		if (SDL_WaitEventTimeout(&ev, 1)) {
+			do
+				event(&ev);
+			while (SDL_PollEvent(&ev));
+		}
+		present(mach);
 	}
 }
 
 int
 main(int argc, char *argv[])
 {
+	int ret;
+
 	parseargs(argc, argv);
-	initsdl();
-	initmach(&mach, renderer, &conf);
-	reset(&mach);
+	if (!play)
+		initsdl();
+	if (share) {
+		if ((ret = openshare(&mach, share)) < 0)
+			fatal("Failed to open shared memory %s: %s", share, strerror(-ret));
+		atexit(closeshare);
+	} else
+		mach = ecalloc(1, sizeof(*mach));
+	initmach(mach, &conf);
+	if (tape) {
+		if ((ret = loadtape(tape)) < 0)
+			fatal("Failed to load tape %s: %s", tape, strerror(-ret));
+		mach->framepc = 010000;
+	}
+	if (framepc)
+		setframepc(mach, framepc);
+	if (play)
+		headless(mach);
+	if (netarg) {
+		if (record)
+			fatal("Movies cannot be recorded during netplay");
+		opensession(netarg);
+		conf.runahead = 0;
+	}
+	if (watch)
+		spectate(mach);
+	initpresent(mach);
+	if (broadcast) {
+		if ((ret = openspec(broadcast, mach)) < 0)
+			fatal("Failed to open spectator ring %s: %s", broadcast, strerror(-ret));
+		atexit(closespec);
+	}
+	initcomp(mach);
+	if (conf.rewind && !net)
+		inithist(mach, conf.rewind);
+	if (video) {
+		if (openvideo(video, mach, conf.fps, false) < 0)
+			fatal("Failed to open video output %s: %s", video, strerror(errno));
+		atexit(closevideo);
+	}
+	reset(mach);
+	if (record) {
+		if ((ret = recordmovie(mach, record)) < 0)
+			fatal("Failed to open movie %s: %s", record, strerror(-ret));
+		atexit(endrecord);
+	}
+	initslots();
+	atexit(syncslots);
 	loop();
 	return 0;
 }
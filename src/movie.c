@@ -0,0 +1,455 @@
+#include "u.h"
+#include "libc.h"
+#include "dat.h"
+#include "fns.h"
+
+/*
+ * A movie file starts with a magic, a version and the frame PC the frames
+ * were counted with. Each record starts with the number of frames since
+ * the last record and a type:
+ *
+ *	0	end: checksum of the final save state and the cycle count
+ *	1	keyframe: control word, cycle count and a save state
+ *	n	the control word read by the (n-1)th read in the frame
+ *
+ * A keyframe is taken at every MOVIEKEY'th frame boundary. After the end
+ * record comes an index of the keyframes, as frame and file offset deltas
+ * from the previous one, then the offset of the index and INDEXMAGIC.
+ * Version 1 files have no keyframes or index and number reads from 1.
+ */
+#define MOVIEMAGIC "SWMV"
+#define INDEXMAGIC "SWIX"
+
+enum {
+	MOVIEVERSION = 2,
+	MOVIEKEY     = 10 * 60,
+
+	REND = 0,
+	RKEY,
+	RREAD,
+};
+
+static void
+putrecord(Movie *mv, u32 frame, u32 read, Word ctl)
+{
+	u8     buf[16];
+	size_t n;
+
+	n = putv(buf, frame - mv->evframe);
+	n += putv(buf + n, RREAD + read - 1);
+	n += put3(buf + n, ctl);
+	fwrite(buf, 1, n, mv->fp);
+	mv->evframe = frame;
+}
+
+static void
+putkey(Movie *mv, Mach *m)
+{
+	u8     buf[32], state[STATEMAX];
+	size_t n, len;
+
+	if (mv->nkey == mv->keycap) {
+		mv->keycap = mv->keycap ? mv->keycap * 2 : 64;
+		mv->key    = ereallocarray(mv->key, mv->keycap, sizeof(*mv->key));
+	}
+	mv->key[mv->nkey].frame = m->nframe;
+	mv->key[mv->nkey].off   = ftell(mv->fp);
+	mv->nkey++;
+
+	len = savestate(m, state);
+	n   = putv(buf, m->nframe - mv->evframe);
+	n += putv(buf + n, RKEY);
+	n += put3(buf + n, mv->ctl);
+	n += put4(buf + n, m->cycles);
+	n += put4(buf + n, m->cycles >> 32);
+	n += putv(buf + n, len);
+	fwrite(buf, 1, n, mv->fp);
+	fwrite(state, 1, len, mv->fp);
+	mv->evframe = m->nframe;
+}
+
+static void
+putend(Movie *mv, Mach *m, u32 sum)
+{
+	u8     buf[32];
+	size_t n;
+	u32    off, frame, prev;
+	uint   i;
+
+	n = putv(buf, m->nframe - mv->evframe);
+	n += putv(buf + n, REND);
+	n += put4(buf + n, sum);
+	n += put4(buf + n, m->cycles);
+	n += put4(buf + n, m->cycles >> 32);
+	fwrite(buf, 1, n, mv->fp);
+
+	off = ftell(mv->fp);
+	n   = putv(buf, mv->nkey);
+	fwrite(buf, 1, n, mv->fp);
+	for (i = frame = prev = 0; i < mv->nkey; i++) {
+		n = putv(buf, mv->key[i].frame - frame);
+		n += putv(buf + n, mv->key[i].off - prev);
+		fwrite(buf, 1, n, mv->fp);
+		frame = mv->key[i].frame;
+		prev  = mv->key[i].off;
+	}
+	n = put4(buf, off);
+	n += putm(buf + n, (u8 *)INDEXMAGIC, 4);
+	fwrite(buf, 1, n, mv->fp);
+}
+
+/*
+ * Decode the keyframe record at p: the control word, cycle count, and the
+ * save state and its length. Returns the length of the record.
+ */
+static size_t
+getkey(Movie *mv, u8 *p, Word *ctl, u64 *cycles, u8 **state, u32 *len)
+{
+	u32    v, lo, hi;
+	u8 *   s;
+	size_t n;
+
+	s = p;
+	if (!(n = getv(p, mv->e, &v)))
+		return 0;
+	p += n;
+	if (!(n = getv(p, mv->e, &v)) || v != RKEY)
+		return 0;
+	p += n;
+	if (mv->e - p < 11)
+		return 0;
+	p += get3(p, ctl);
+	p += get4(p, &lo);
+	p += get4(p, &hi);
+	if (!(n = getv(p, mv->e, len)) || (size_t)(mv->e - p) - n < *len)
+		return 0;
+	p += n;
+
+	*cycles = (u64)hi << 32 | lo;
+	*state  = p;
+	return p + *len - s;
+}
+
+/* decode the next read or end record into evframe and evread, skipping keyframes */
+static int
+getrecord(Movie *mv)
+{
+	u32    dframe, type, lo, hi, len;
+	size_t n, k;
+	Word   ctl;
+	u64    cycles;
+	u8 *   state;
+
+	for (;;) {
+		if (!(n = getv(mv->p, mv->e, &dframe)) || !(k = getv(mv->p + n, mv->e, &type)))
+			return -EINVAL;
+		if (mv->version == 1 && type != REND)
+			type++;
+
+		if (type == RKEY) {
+			if (!(n = getkey(mv, mv->p, &ctl, &cycles, &state, &len)))
+				return -EINVAL;
+			mv->p += n;
+			mv->evframe += dframe;
+			continue;
+		}
+		mv->p += n + k;
+		if (mv->e - mv->p < ((type == REND) ? 12 : 3))
+			return -EINVAL;
+
+		mv->evframe += dframe;
+		if (type != REND) {
+			mv->evread = type - RREAD + 1;
+			mv->p += get3(mv->p, &mv->evctl);
+		} else {
+			mv->evread = 0;
+			mv->p += get4(mv->p, &mv->sum);
+			mv->p += get4(mv->p, &lo);
+			mv->p += get4(mv->p, &hi);
+			mv->endframe  = mv->evframe;
+			mv->endcycles = (u64)hi << 32 | lo;
+		}
+		return 0;
+	}
+}
+
+static u32
+statesum(Mach *m)
+{
+	u8 buf[STATEMAX];
+
+	return checksum(buf, savestate(m, buf));
+}
+
+/* record the control word from reset on */
+int
+recordmovie(Mach *m, const char *name)
+{
+	Movie *mv;
+	u8     buf[16];
+	size_t n;
+
+	mv     = ecalloc(1, sizeof(*mv));
+	mv->fp = fopen(name, "wb");
+	if (!mv->fp) {
+		free(mv);
+		return -errno;
+	}
+
+	n = putm(buf, (u8 *)MOVIEMAGIC, 4);
+	n += put1(buf + n, MOVIEVERSION);
+	n += put3(buf + n, m->framepc);
+	fwrite(buf, 1, n, mv->fp);
+
+	reset(m);
+	m->ctl   = 0;
+	m->movie = mv;
+	return 0;
+}
+
+static int
+getindex(Movie *mv)
+{
+	u8 * p, *e;
+	u32  off, n, v, frame, prev;
+	uint i;
+
+	if (mv->e - mv->buf < 8 || memcmp(mv->e - 4, INDEXMAGIC, 4))
+		return -EINVAL;
+	get4(mv->e - 8, &off);
+	if (off > (size_t)(mv->e - mv->buf) - 8)
+		return -EINVAL;
+
+	p = mv->buf + off;
+	e = mv->e - 8;
+	if (!(i = getv(p, e, &n)) || n > (size_t)(e - p))
+		return -EINVAL;
+	p += i;
+
+	mv->key  = ecalloc(n + 1, sizeof(*mv->key));
+	mv->nkey = n;
+	for (i = frame = prev = 0; i < n; i++) {
+		if (!(v = getv(p, e, &off)))
+			return -EINVAL;
+		p += v;
+		frame += off;
+		if (!(v = getv(p, e, &off)))
+			return -EINVAL;
+		p += v;
+		prev += off;
+		if (prev >= (size_t)(mv->e - mv->buf))
+			return -EINVAL;
+		mv->key[i].frame = frame;
+		mv->key[i].off   = prev;
+	}
+
+	/* records stop where the index starts */
+	get4(mv->e - 8, &off);
+	mv->e = mv->buf + off;
+	return 0;
+}
+
+/* play a movie from reset; the machine must run the same program */
+int
+playmovie(Mach *m, const char *name)
+{
+	Movie *mv;
+	FILE * fp;
+	long   n;
+	Word   pc;
+	int    ret;
+
+	fp = fopen(name, "rb");
+	if (!fp)
+		return -errno;
+
+	mv  = ecalloc(1, sizeof(*mv));
+	ret = -EINVAL;
+	if (fseek(fp, 0, SEEK_END) < 0 || (n = ftell(fp)) < 4 + 1 + 3 || fseek(fp, 0, SEEK_SET) < 0)
+		goto err;
+
+	mv->buf = ecalloc(1, n);
+	if (fread(mv->buf, 1, n, fp) != (size_t)n)
+		goto err;
+	mv->p = mv->buf;
+	mv->e = mv->buf + n;
+	if (memcmp(mv->p, MOVIEMAGIC, 4))
+		goto err;
+	mv->p += 4;
+	mv->p += get1(mv->p, &mv->version);
+	mv->p += get3(mv->p, &pc);
+	if (mv->version < 1 || mv->version > MOVIEVERSION)
+		goto err;
+	if (mv->version >= 2 && getindex(mv) < 0)
+		goto err;
+
+	/* check the records up to the end record before playing any */
+	mv->start = mv->p;
+	do {
+		if (getrecord(mv) < 0)
+			goto err;
+	} while (mv->evread);
+	mv->p       = mv->start;
+	mv->evframe = 0;
+	getrecord(mv);
+
+	mv->play = true;
+	fclose(fp);
+
+	m->framepc = pc;
+	reset(m);
+	m->ctl   = 0;
+	m->movie = mv;
+	return 0;
+
+err:
+	fclose(fp);
+	free(mv->key);
+	free(mv->buf);
+	free(mv);
+	return ret;
+}
+
+/*
+ * Move a playing movie to the boundary that starts frame. The machine is
+ * restored from the last keyframe at or before it and emulated from there,
+ * so a seek never runs more than MOVIEKEY frames.
+ */
+int
+seekmovie(Mach *m, u32 frame)
+{
+	Movie *mv;
+	Word   ctl;
+	u64    cycles;
+	u8 *   state;
+	u32    len;
+	uint   lo, hi, i;
+	int    ret;
+
+	mv = m->movie;
+	if (!mv || !mv->play)
+		return -EINVAL;
+	if (frame > mv->endframe)
+		return -ERANGE;
+
+	for (lo = 0, hi = mv->nkey; lo < hi;) {
+		i = (lo + hi) / 2;
+		if (mv->key[i].frame <= frame)
+			lo = i + 1;
+		else
+			hi = i;
+	}
+
+	if (lo == 0 || (frame >= m->nframe && m->nframe >= mv->key[lo - 1].frame)) {
+		/* nothing closer than where we are or the start */
+		if (frame < m->nframe) {
+			reset(m);
+			m->ctl      = 0;
+			mv->ctl     = 0;
+			mv->frame   = 0;
+			mv->read    = 0;
+			mv->p       = mv->start;
+			mv->evframe = 0;
+			getrecord(mv);
+		}
+	} else {
+		if (!getkey(mv, mv->buf + mv->key[lo - 1].off, &ctl, &cycles, &state, &len))
+			return -EINVAL;
+		if ((ret = loadstate(m, state, len)) < 0)
+			return ret;
+		m->ctl       = ctl;
+		m->cycles    = cycles;
+		m->framemark = cycles;
+		m->nframe    = mv->key[lo - 1].frame;
+
+		mv->ctl     = ctl;
+		mv->frame   = m->nframe;
+		mv->read    = 0;
+		mv->p       = mv->buf + mv->key[lo - 1].off;
+		mv->evframe = m->nframe;
+		mv->p += getkey(mv, mv->p, &ctl, &cycles, &state, &len);
+		getrecord(mv);
+	}
+
+	while (m->nframe < frame && !m->halt) {
+		step(m);
+		frameend(m);
+	}
+	return 0;
+}
+
+/*
+ * Called for every read of the control word with the value the machine
+ * would read; returns the value it reads.
+ */
+Word
+movieinput(Movie *mv, u32 frame, Word ctl)
+{
+	if (frame != mv->frame) {
+		mv->frame = frame;
+		mv->read  = 0;
+	}
+	mv->read++;
+
+	if (!mv->play) {
+		if (ctl != mv->ctl)
+			putrecord(mv, frame, mv->read, ctl);
+		mv->ctl = ctl;
+		return ctl;
+	}
+
+	while (mv->evread && mv->evframe == frame && mv->evread == mv->read) {
+		mv->ctl = mv->evctl;
+		getrecord(mv);
+	}
+	return mv->ctl;
+}
+
+/* called at every frame boundary */
+void
+movieframe(Movie *mv, Mach *m)
+{
+	if (!mv->play && m->nframe % MOVIEKEY == 0)
+		putkey(mv, m);
+}
+
+/* the end of the movie, or past it if playback went astray */
+bool
+movieend(Mach *m)
+{
+	Movie *mv;
+
+	mv = m->movie;
+	return mv && mv->play && (m->nframe >= mv->endframe || m->cycles >= mv->endcycles);
+}
+
+/*
+ * Finish a recording, or check a finished playback: -EILSEQ if the machine
+ * did not end up where the recording did.
+ */
+int
+closemovie(Mach *m)
+{
+	Movie *mv;
+	int    ret;
+
+	mv = m->movie;
+	if (!mv)
+		return 0;
+
+	ret = 0;
+	if (!mv->play) {
+		putend(mv, m, statesum(m));
+		if (fclose(mv->fp) < 0)
+			ret = -errno;
+	} else {
+		if (m->nframe != mv->endframe || m->cycles != mv->endcycles || statesum(m) != mv->sum)
+			ret = -EILSEQ;
+		free(mv->buf);
+	}
+
+	free(mv->key);
+	free(mv);
+	m->movie = NULL;
+	return ret;
+}
@@ -0,0 +1,359 @@
+#include "u.h"
+#include "libc.h"
+#include "dat.h"
+#include "fns.h"
+
+/*
+ * Two player netplay over UDP. Each side owns one player's half of the
+ * control word and sends its inputs for every frame, a few frames ahead of
+ * when they are used (the input delay). Inputs the other side has not
+ * acknowledged are repeated in every packet, so a lost packet costs
+ * nothing but time.
+ *
+ * A frame whose remote input has not arrived runs with the last known one.
+ * The machine is forked at the start of every frame; when the real input
+ * turns out to differ from the guess, the machine is joined back to the
+ * fork of the first wrong frame and the frames since are run again. A side
+ * that gets NETMAX frames ahead of the inputs it has waits.
+ *
+ * For testing on one host, outgoing packets can be held back by a fixed
+ * delay and dropped at random.
+ */
+#define NETMAGIC "SWNP"
+
+enum {
+	NETRING   = 32,
+	NETMAX    = 8,
+	NETQUEUE  = 256,
+	NETPKT    = 4 + 4 + 4 + 1 + NETRING * 3,
+	NETRESEND = 16,
+};
+
+typedef struct {
+	u32 due;
+	int len;
+	u8  buf[NETPKT];
+} Packet;
+
+struct Net {
+#if !defined(__WINDOWS__) && !defined(__WINRT__)
+	int                fd;
+	struct sockaddr_in peer;
+#endif
+	Word mask;
+	int  shift;
+	uint delay;
+	uint lag, loss;
+
+	Word  local[NETRING];
+	Word  remote[NETRING];
+	Word  used[NETRING];
+	Fork *snap[NETRING];
+
+	u32 sent;
+	u32 acked;
+	u32 confirmed;
+	u32 rollback;
+	u32 lastsend;
+
+	Packet q[NETQUEUE];
+	uint   qhead, qcount;
+
+	u32 rollbacks, resims;
+};
+
+/* the local inputs from either player's controls, as this side's player */
+static Word
+localinput(Net *n, Word ctl)
+{
+	return (((ctl | ctl >> 14) & 017) << n->shift) & n->mask;
+}
+
+static Word
+remoteinput(Net *n, u32 frame)
+{
+	if (frame < n->confirmed)
+		return n->remote[frame % NETRING];
+	if (n->confirmed == 0)
+		return 0;
+	return n->remote[(n->confirmed - 1) % NETRING];
+}
+
+#if !defined(__WINDOWS__) && !defined(__WINRT__)
+
+int
+opennet(Net **np, int player, int port, const char *host, int rport, uint delay, uint lag, uint loss)
+{
+	struct sockaddr_in sa;
+	Net *              n;
+	int                ret;
+
+	if (player < 1 || player > 2 || delay > MAXNETDELAY)
+		return -EINVAL;
+
+	n = ecalloc(1, sizeof(*n));
+	memset(&n->peer, 0, sizeof(n->peer));
+	n->peer.sin_family = AF_INET;
+	n->peer.sin_port   = htons(rport);
+	if (inet_pton(AF_INET, host, &n->peer.sin_addr) != 1) {
+		free(n);
+		return -EINVAL;
+	}
+
+	n->fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (n->fd < 0) {
+		ret = -errno;
+		free(n);
+		return ret;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family      = AF_INET;
+	sa.sin_port        = htons(port);
+	sa.sin_addr.s_addr = htonl(INADDR_ANY);
+	if (bind(n->fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 || fcntl(n->fd, F_SETFL, O_NONBLOCK) < 0) {
+		ret = -errno;
+		close(n->fd);
+		free(n);
+		return ret;
+	}
+
+	n->shift = (player == 1) ? 0 : 14;
+	n->mask  = (player == 1) ? 017 : 0740000;
+	n->delay = delay;
+	n->lag   = lag;
+	n->loss  = loss;
+	*np      = n;
+	return 0;
+}
+
+static void
+sendraw(Net *n, u8 *buf, int len)
+{
+	sendto(n->fd, buf, len, 0, (struct sockaddr *)&n->peer, sizeof(n->peer));
+}
+
+static int
+recvraw(Net *n, u8 *buf, int len)
+{
+	return recv(n->fd, buf, len, 0);
+}
+
+void
+closenet(Net *n)
+{
+	uint i;
+
+	if (!n)
+		return;
+	for (i = 0; i < NETRING; i++)
+		freefork(n->snap[i]);
+	close(n->fd);
+	free(n);
+}
+
+#else
+
+int
+opennet(Net **np, int player, int port, const char *host, int rport, uint delay, uint lag, uint loss)
+{
+	(void)np, (void)player, (void)port, (void)host, (void)rport;
+	(void)delay, (void)lag, (void)loss;
+	return -ENOSYS;
+}
+
+static void
+sendraw(Net *n, u8 *buf, int len)
+{
+	(void)n, (void)buf, (void)len;
+}
+
+static int
+recvraw(Net *n, u8 *buf, int len)
+{
+	(void)n, (void)buf, (void)len;
+	return -1;
+}
+
+void
+closenet(Net *n)
+{
+	(void)n;
+}
+
+#endif
+
+/* send now, or through the simulated lag and loss */
+static void
+sendpkt(Net *n, u8 *buf, int len)
+{
+	Packet *p;
+
+	if (n->loss && (uint)(rand() % 100) < n->loss)
+		return;
+	if (!n->lag) {
+		sendraw(n, buf, len);
+		return;
+	}
+	if (n->qcount == NETQUEUE)
+		return;
+
+	p      = &n->q[(n->qhead + n->qcount++) % NETQUEUE];
+	p->due = SDL_GetTicks() + n->lag;
+	p->len = len;
+	memcpy(p->buf, buf, len);
+}
+
+static void
+flushq(Net *n)
+{
+	Packet *p;
+	u32     t;
+
+	t = SDL_GetTicks();
+	while (n->qcount > 0) {
+		p = &n->q[n->qhead];
+		if ((s32)(t - p->due) < 0)
+			break;
+		sendraw(n, p->buf, p->len);
+		n->qhead = (n->qhead + 1) % NETQUEUE;
+		n->qcount--;
+	}
+}
+
+/* our inputs the other side has not acknowledged, and what we have of theirs */
+static void
+sendinputs(Net *n)
+{
+	u8  buf[NETPKT], *p;
+	u32 first, count, i;
+
+	first = n->acked;
+	if (n->sent - first > NETRING)
+		first = n->sent - NETRING;
+	count = n->sent - first;
+	p     = buf;
+	p += putm(p, (u8 *)NETMAGIC, 4);
+	p += put4(p, first);
+	p += put4(p, n->confirmed);
+	p += put1(p, count);
+	for (i = 0; i < count; i++)
+		p += put3(p, n->local[(first + i) % NETRING]);
+
+	sendpkt(n, buf, p - buf);
+	n->lastsend = SDL_GetTicks();
+}
+
+static void
+recvinputs(Net *n, u32 frame)
+{
+	u8   buf[NETPKT], *p, count;
+	u32  first, ack, g, i;
+	Word v;
+	int  len;
+
+	while ((len = recvraw(n, buf, sizeof(buf))) > 0) {
+		if (len < 13 || memcmp(buf, NETMAGIC, 4))
+			continue;
+		p = buf + 4;
+		p += get4(p, &first);
+		p += get4(p, &ack);
+		p += get1(p, &count);
+		if (len < 13 + count * 3)
+			continue;
+
+		if (ack > n->acked && ack <= n->sent)
+			n->acked = ack;
+
+		for (i = 0; i < count; i++) {
+			p += get3(p, &v);
+			g = first + i;
+			if (g != n->confirmed || g >= frame + NETRING - NETMAX)
+				continue;
+
+			v &= ~n->mask & (017 | 0740000);
+			n->remote[g % NETRING] = v;
+			n->confirmed++;
+			if (g < frame && v != n->used[g % NETRING] && g < n->rollback)
+				n->rollback = g;
+		}
+	}
+}
+
+static void
+snapshot(Net *n, Mach *m, u32 frame)
+{
+	freefork(n->snap[frame % NETRING]);
+	n->snap[frame % NETRING] = forkmach(m);
+}
+
+static void
+setinput(Net *n, Mach *m, u32 frame)
+{
+	n->used[frame % NETRING] = remoteinput(n, frame);
+	m->ctl                   = n->local[frame % NETRING] | n->used[frame % NETRING];
+}
+
+/* go back to the first mispredicted frame and run up to frame again */
+static void
+resimulate(Net *n, Mach *m, u32 frame)
+{
+	u32  g;
+	bool nodraw;
+
+	joinfork(m, n->snap[n->rollback % NETRING]);
+	nodraw    = m->nodraw;
+	m->nodraw = true;
+	for (g = n->rollback; g < frame && !m->halt; g++) {
+		if (g > n->rollback)
+			snapshot(n, m, g);
+		setinput(n, m, g);
+		do
+			step(m);
+		while (!frameend(m) && !m->halt);
+		n->resims++;
+	}
+	m->nodraw = nodraw;
+	n->rollbacks++;
+	n->rollback = ~0u;
+}
+
+/*
+ * Called at the start of every frame, with the machine at the boundary.
+ * Exchanges inputs, corrects the past if needed and sets up the control
+ * word for the frame. Returns false if the frame cannot run yet; call
+ * again until it can.
+ */
+bool
+netframe(Net *n, Mach *m, Word ctl)
+{
+	u32 frame;
+
+	frame       = m->nframe;
+	n->rollback = ~0u;
+	flushq(n);
+	recvinputs(n, frame);
+	if (n->rollback != ~0u)
+		resimulate(n, m, frame);
+
+	while (n->sent <= frame + n->delay)
+		n->local[n->sent++ % NETRING] = localinput(n, ctl);
+
+	if (n->sent > n->acked && SDL_GetTicks() - n->lastsend >= NETRESEND)
+		sendinputs(n);
+	if (frame >= n->confirmed + NETMAX)
+		return false;
+
+	snapshot(n, m, frame);
+	setinput(n, m, frame);
+	sendinputs(n);
+	return true;
+}
+
+void
+netstats(Net *n, u32 *confirmed, u32 *rollbacks, u32 *resims)
+{
+	*confirmed = n->confirmed;
+	*rollbacks = n->rollbacks;
+	*resims    = n->resims;
+}
@@ -0,0 +1,156 @@
+#include "u.h"
+#include "libc.h"
+#include "dat.h"
+#include "fns.h"
+
+/*
+ * Observation kernels: the display shrunk to side x side keeping the
+ * brightest pixel of each block, the pixelwise max of two frames, and the
+ * same shrinking done straight from the points plotted in a frame.
+ *
+ * A block's max is taken in two passes. The rows of the block are maxed
+ * together 16 bytes at a time, then the columns come from a sparse table
+ * over that row: level k holds the max of 2^k bytes starting at each byte,
+ * so a block of L columns is the max of two overlapping entries at the
+ * level with 2^k <= L. Only the levels needed for the block width are
+ * built.
+ */
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+typedef __m128i V;
+#define vload(p) _mm_loadu_si128((const __m128i *)(p))
+#define vstore(p, v) _mm_storeu_si128((__m128i *)(p), v)
+#define vmax(a, b) _mm_max_epu8(a, b)
+#define vzero() _mm_setzero_si128()
+#define VEC 16
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+
+typedef uint8x16_t V;
+#define vload(p) vld1q_u8(p)
+#define vstore(p, v) vst1q_u8(p, v)
+#define vmax(a, b) vmaxq_u8(a, b)
+#define vzero() vdupq_n_u8(0)
+#define VEC 16
+#endif
+
+enum {
+	NLEVEL = 10,
+	ROWPAD = 512,
+};
+
+static void
+maxrows(u8 *dst, Mach *m, uint y0, uint y1)
+{
+	uint y;
+	int  x;
+	u8 * p;
+
+	memset(dst, 0, m->dx);
+	for (y = y0; y < y1; y++) {
+		if (!m->live[y])
+			continue;
+		p = m->pix[y];
+#ifdef VEC
+		for (x = 0; x + VEC <= m->dx; x += VEC)
+			vstore(dst + x, vmax(vload(dst + x), vload(p + x)));
+#else
+		x = 0;
+#endif
+		for (; x < m->dx; x++)
+			dst[x] = (p[x] > dst[x]) ? p[x] : dst[x];
+	}
+}
+
+/* level k from level k-1, n bytes; bytes past n read the zero padding */
+static void
+maxpairs(u8 *dst, u8 *src, int n, int d)
+{
+	int x;
+
+#ifdef VEC
+	for (x = 0; x + VEC <= n; x += VEC)
+		vstore(dst + x, vmax(vload(src + x), vload(src + x + d)));
+#else
+	x = 0;
+#endif
+	for (; x < n; x++)
+		dst[x] = (src[x + d] > src[x]) ? src[x + d] : src[x];
+}
+
+static int
+log2floor(uint n)
+{
+	int k;
+
+	for (k = 0; (2u << k) <= n; k++)
+		;
+	return k;
+}
+
+void
+downsample(u8 *dst, uint side, Mach *m)
+{
+	u8   s[NLEVEL][512 + ROWPAD], lv[512];
+	u16  c0[512], c1[512];
+	uint x, y;
+	int  k, top;
+	u8 * t, v, w;
+
+	/* side <= dx, so every block has at least one column */
+	top = 0;
+	for (x = 0; x < side; x++) {
+		c0[x] = x * m->dx / side;
+		lv[x] = log2floor((x + 1) * m->dx / side - c0[x]);
+		c1[x] = (x + 1) * m->dx / side - (1 << lv[x]);
+		top   = (lv[x] > top) ? lv[x] : top;
+	}
+	for (k = 0; k <= top; k++)
+		memset(s[k] + m->dx, 0, ROWPAD);
+
+	for (y = 0; y < side; y++) {
+		maxrows(s[0], m, y * m->dy / side, (y + 1) * m->dy / side);
+		for (k = 1; k <= top; k++)
+			maxpairs(s[k], s[k - 1], m->dx, 1 << (k - 1));
+
+		for (x = 0; x < side; x++) {
+			t                 = s[lv[x]];
+			v                 = t[c0[x]];
+			w                 = t[c1[x]];
+			dst[y * side + x] = (v > w) ? v : w;
+		}
+	}
+}
+
+/* the points plotted since the last call, each as bright as a fresh hit */
+void
+plotpoints(u8 *dst, uint side, Mach *m)
+{
+	uint i, x, y;
+	u8 * p;
+
+	memset(dst, 0, side * side);
+	for (i = 0; i < m->npts; i++) {
+		x  = (m->pts[i] & 0777) * side / m->dx;
+		y  = (m->pts[i] >> 9) * side / m->dy;
+		p  = &dst[y * side + x];
+		*p = min(*p + 128, 255);
+	}
+	m->npts = 0;
+}
+
+void
+maxpool(u8 *dst, const u8 *a, const u8 *b, size_t n)
+{
+	size_t i;
+
+#ifdef VEC
+	for (i = 0; i + VEC <= n; i += VEC)
+		vstore(dst + i, vmax(vload(a + i), vload(b + i)));
+#else
+	i = 0;
+#endif
+	for (; i < n; i++)
+		dst[i] = (a[i] > b[i]) ? a[i] : b[i];
+}
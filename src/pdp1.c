@@ -8,103 +8,190 @@ static const Word sign = 0400000;
 
 extern const char *spacewar_rom[];
 
-void
-savestate(Mach *m, void *buf)
+/*
+ * Pristine program image and the source line of each word in it, see
+ * parserom(). Both are shared by all machines and read-only once loaded.
+ */
+static Word rom[010000];
+static u16  romsym[010000];
+static Word romstart = 4;
+static bool romready;
+
+static void parserom(void);
+
+static u8
+packbits(u8 *b, size_t n)
+{
+	size_t i;
+	u8     v;
+
+	for (i = v = 0; i < n; i++)
+		v |= (b[i] != 0) << i;
+	return v;
+}
+
+static void
+unpackbits(u8 *b, size_t n, u8 v)
 {
 	size_t i;
 
-	u8 *p;
+	for (i = 0; i < n; i++)
+		b[i] = (v >> i) & 1;
+}
+
+size_t
+savestate(Mach *m, void *buf)
+{
+	Word a, n;
+	u8 * p;
 
 	p = buf;
-	p += put4(p, m->ac);
-	p += put4(p, m->io);
-	p += put4(p, m->pc);
-	p += put4(p, m->ov);
-	for (i = 0; i < nelem(m->mem); i++)
-		p += put4(p, m->mem[i]);
-	p += putm(p, m->flag, sizeof(m->flag));
-	p += putm(p, m->sense, sizeof(m->sense));
+	p += putm(p, (u8 *)STATEMAGIC, 4);
+	p += put1(p, STATEVERSION);
+	p += put3(p, m->ac);
+	p += put3(p, m->io);
+	p += put3(p, m->pc);
+	p += put1(p, m->ov);
+	p += put1(p, packbits(m->flag, nelem(m->flag)));
+	p += put1(p, packbits(m->sense, nelem(m->sense)));
 	p += put1(p, m->halt);
-	for (i = 0; i < nelem(m->sym); i++)
-		p += put4(p, m->sym[i]);
+
+	for (a = 0; a < nelem(m->mem);) {
+		for (n = a; n < nelem(m->mem) && m->mem[n] == rom[n]; n++)
+			;
+		p += putv(p, n - a);
+
+		for (a = n; n < nelem(m->mem) && m->mem[n] != rom[n]; n++)
+			;
+		p += putv(p, n - a);
+
+		for (; a < n; a++)
+			p += put3(p, m->mem[a]);
+	}
+
+	return p - (u8 *)buf;
 }
 
-void
-loadstate(Mach *m, void *buf)
+static int
+loadoldstate(Mach *m, u8 *p)
 {
 	size_t i;
 
-	u8 *p;
-
-	p = buf;
 	p += get4(p, &m->ac);
 	p += get4(p, &m->io);
 	p += get4(p, &m->pc);
 	p += get4(p, &m->ov);
-	for (i = 0; i < nelem(m->mem); i++)
+	for (i = 0; i < nelem(m->mem); i++) {
 		p += get4(p, &m->mem[i]);
+		m->mem[i] &= 0777777;
+	}
+	m->ac &= 0777777;
+	m->io &= 0777777;
+	m->pc &= 07777;
+	m->ov &= 1;
 	p += getm(m->flag, p, sizeof(m->flag));
 	p += getm(m->sense, p, sizeof(m->sense));
 	p += get1(p, &m->halt);
-	for (i = 0; i < nelem(m->sym); i++)
-		p += get4(p, &m->sym[i]);
-}
-
-int
-savestate_f(Mach *m, uint slot)
-{
-	FILE *fp;
-	int   ret;
-
-	if (slot >= nelem(m->state))
-		return -EINVAL;
-
-	fp = xfopen("%u.sav", "wb", slot);
-	if (!fp)
-		return -errno;
-
-	ret = 0;
-	memset(m->state[slot], 0, sizeof(m->state[slot]));
-	savestate(m, m->state[slot]);
-	if (fwrite(m->state[slot], 1, sizeof(m->state[slot]), fp) != sizeof(m->state[slot]))
-		ret = -errno;
-
-	fclose(fp);
+	memset(m->written, 0, sizeof(m->written));
+	for (i = 0; i < nelem(m->mem); i++) {
+		if (m->mem[i] != rom[i])
+			m->written[i / 64] |= (u64)1 << (i % 64);
+	}
+	m->dirty = m->stale = ~(u64)0;
 
-	return ret;
+	return 0;
 }
 
 int
-loadstate_f(Mach *m, uint slot)
+loadstate(Mach *m, void *buf, size_t size)
 {
-	FILE *fp;
+	Word   mem[010000], ac, io, pc;
+	u32    a, skip, n;
+	u8 *   p, *e, ver, ov, flag, sense, halt;
+	size_t len;
 
-	if (slot >= nelem(m->state))
+	p = buf;
+	e = p + size;
+	if (size < 4 || memcmp(p, STATEMAGIC, 4)) {
+		if (size < OLDSTATESIZE)
+			return -EINVAL;
+		return loadoldstate(m, p);
+	}
+
+	if (size < 4 + 1 + 3 * 3 + 4)
+		return -EINVAL;
+	p += 4;
+	p += get1(p, &ver);
+	if (ver != STATEVERSION)
 		return -EINVAL;
 
-	fp = xfopen("%u.sav", "rb", slot);
-	if (!fp)
-		return -errno;
+	p += get3(p, &ac);
+	p += get3(p, &io);
+	p += get3(p, &pc);
+	p += get1(p, &ov);
+	p += get1(p, &flag);
+	p += get1(p, &sense);
+	p += get1(p, &halt);
+	if (ac > 0777777 || io > 0777777 || pc > 07777 || ov > 1)
+		return -EINVAL;
 
-	if (fread(m->state[slot], 1, sizeof(m->state[slot]), fp) != sizeof(m->state[slot]))
-		return -errno;
+	memcpy(mem, rom, sizeof(mem));
+	for (a = 0; a < nelem(mem);) {
+		if (!(len = getv(p, e, &skip)))
+			return -EINVAL;
+		p += len;
+		if (!(len = getv(p, e, &n)))
+			return -EINVAL;
+		p += len;
+
+		if (skip > nelem(mem) - a || n > nelem(mem) - a - skip || (size_t)(e - p) < n * 3)
+			return -EINVAL;
+		for (a += skip; n > 0; n--) {
+			p += get3(p, &mem[a]);
+			if (mem[a++] > 0777777)
+				return -EINVAL;
+		}
+	}
 
-	loadstate(m, m->state[slot]);
-	fclose(fp);
+	m->ac = ac;
+	m->io = io;
+	m->pc = pc;
+	m->ov = ov;
+	unpackbits(m->flag, nelem(m->flag), flag);
+	unpackbits(m->sense, nelem(m->sense), sense);
+	m->halt = halt;
+	memset(m->written, 0, sizeof(m->written));
+	for (a = 0; a < nelem(mem); a++) {
+		m->mem[a] = mem[a];
+		if (mem[a] != rom[a])
+			m->written[a / 64] |= (u64)1 << (a % 64);
+	}
+	m->dirty = m->stale = ~(u64)0;
 
 	return 0;
 }
 
-void
-loadrom(Mach *m)
+/*
+ * The text dump is parsed into the pristine image when the first machine is
+ * made; every later load is a copy of it. The lock lets machines be made on
+ * several threads at once.
+ */
+static void
+parserom(void)
 {
-	const char *line;
-	size_t      len, i, j, n;
-	Word        a, v;
+	static SDL_SpinLock lock;
+	const char *        line;
+	size_t              len, i, j, n;
+	Word                a, v;
+
+	SDL_AtomicLock(&lock);
+	if (romready) {
+		SDL_AtomicUnlock(&lock);
+		return;
+	}
 
-	memset(m->mem, 0, sizeof(m->mem));
-	for (n = 0; n < nelem(m->sym); n++) {
-		m->sym[n] = 0xffffffff;
+	for (n = 0; n < nelem(romsym); n++) {
+		romsym[n] = NOSYM;
 	}
 
 	for (n = 0; (line = spacewar_rom[n]); n++) {
@@ -123,20 +210,44 @@ loadrom(Mach *m)
 		for (i++; i < len && '0' <= line[i] && line[i] <= '7'; i++)
 			v = v * 8 + line[i] - '0';
 
-		if (i == j)
+		if (i == j || n >= NOSYM)
 			continue;
 
-		m->mem[a] = v;
-		m->sym[a] = n;
+		rom[a]    = v;
+		romsym[a] = n;
 	}
+
+	romready = true;
+	SDL_AtomicUnlock(&lock);
 }
 
+/* replace the pristine image with another program, which has no source */
 void
-initmach(Mach *m, SDL_Renderer *re, Config *conf)
+setrom(Word *mem, Word start)
+{
+	size_t n;
+
+	memcpy(rom, mem, sizeof(rom));
+	for (n = 0; n < nelem(romsym); n++)
+		romsym[n] = NOSYM;
+	romstart = start & 07777;
+	romready = true;
+}
+
+void
+loadrom(Mach *m)
+{
+	memcpy(m->mem, rom, sizeof(m->mem));
+	memset(m->written, 0, sizeof(m->written));
+}
+
+void
+initmach(Mach *m, Config *conf)
 {
 	size_t i;
 	u8     r, g, b;
 
+	parserom();
 	for (i = 0; i < nelem(m->cmap); i++) {
 		r = 0;
 		g = min(i * 2, 255);
@@ -150,20 +261,27 @@ initmach(Mach *m, SDL_Renderer *re, Config *conf)
 		m->cmap[i] = r | g << 8 | b << 16 | 0xff000000;
 	}
 
+	for (i = 0; i < nelem(m->decay); i++)
+		m->decay[i] = 256 * pow(2, -(double)i * DECAYSTEP / HALFLIFE) + 0.5;
+
 	m->dx = m->dy = 512;
-	m->tex        = SDL_CreateTexture(re, SDL_PIXELFORMAT_ABGR8888, SDL_TEXTUREACCESS_STREAMING, m->dx, m->dy);
-	if (!m->tex)
-		fatal("Failed to create texture for display: %s", SDL_GetError());
+	m->framepc    = 02051;
+	for (i = 0; i < nelem(m->rowgen); i++)
+		m->rowgen[i] = 1;
 }
 
 void
 reset(Mach *m)
 {
 	loadrom(m);
+	m->dirty = m->stale = ~(u64)0;
 	m->ac = m->io = m->ov = m->halt = 0;
-	m->pc                           = 4;
+	m->pc                           = romstart;
 	memset(m->flag, 0, sizeof(m->flag));
 	memset(m->sense, 0, sizeof(m->sense));
+	m->cycles    = 0;
+	m->framemark = 0;
+	m->nframe    = 0;
 	m->frametime = SDL_GetTicks();
 }
 
@@ -173,31 +291,98 @@ memread(Mach *m, Word a)
 	return m->mem[a & 07777];
 }
 
+static void
+event(Mach *m, int type, int player, Word score)
+{
+	Event *e;
+
+	if (m->nev == NEVENT)
+		return;
+	e         = &m->ev[m->nev++];
+	e->frame  = m->nframe + 1;
+	e->type   = type;
+	e->player = player;
+	e->score  = score;
+}
+
+static bool
+shipkind(Word w)
+{
+	w &= 07777;
+	return w == SS1 || w == SS2 || w == HP1 || w == HP3;
+}
+
+static void
+watch(Mach *m, Word a, Word v)
+{
+	Word old;
+
+	old = m->mem[a];
+	if (a == SC1 || a == SC2) {
+		if (v > old)
+			event(m, ESCORE, a - SC1, v);
+	} else if ((v & 07777) == MEX && shipkind(old))
+		event(m, EDEATH, a - MTB, 0);
+	else if (a == MTB && v == SS1 && old == 0 && m->nframe > 0)
+		event(m, EROUND, 0, 0);
+}
+
+static void
+store(Mach *m, Word a, Word v)
+{
+	if (m->ev && (a - SC1 < 2 || a - MTB < 2))
+		watch(m, a, v);
+	m->mem[a] = v;
+	m->written[a / 64] |= (u64)1 << (a % 64);
+	m->dirty |= (u64)1 << (a / PAGESIZE);
+	m->stale |= (u64)1 << (a / PAGESIZE);
+}
+
 void
 memwrite(Mach *m, Word a, Word v)
 {
-	m->mem[a & 07777] = v;
+	store(m, a & 07777, v);
 }
 
 void
 step(Mach *m)
 {
 	Word inst;
-	Inst ip;
 
-	disasm(&ip, m, m->pc);
 	if (m->halt)
 		return;
 
-	if (ip.mode & AMEM)
-		m->sym[ip.addr] = 0xffffffff;
-
-	/* printf("%04x %s", m->pc, ip.str); */
+	/* Inst ip; disasm(&ip, m, m->pc); printf("%04x %s", m->pc, ip.str); */
 	inst = memread(m, m->pc++);
+	m->cycles++;
 	if (exec(m, inst))
 		m->halt |= 0x1;
 }
 
+/*
+ * A frame ends when the program reaches the frame PC, the top of the
+ * Spacewar main loop. Programs without one are cut into frames of
+ * FRAMECYCLES memory cycles. Frames are counted from reset in nframe.
+ */
+bool
+frameend(Mach *m)
+{
+	if (m->halt)
+		return false;
+	if (m->framepc < 010000) {
+		if (m->pc != m->framepc)
+			return false;
+	} else {
+		if (m->cycles >= m->framemark && m->cycles - m->framemark < FRAMECYCLES)
+			return false;
+		m->framemark = m->cycles;
+	}
+	m->nframe++;
+	if (m->movie)
+		movieframe(m->movie, m);
+	return true;
+}
+
 static Word
 norm(Word i)
 {
@@ -219,15 +404,92 @@ trap(Mach *m, Word a)
 		y = (m->io + 0400000) & 0777777;
 		x = x * m->dx / 0777777;
 		y = y * m->dy / 0777777;
-		if (0 <= x && x < m->dx && 0 <= y && y < m->dy)
-			m->pix[y][x] = min(m->pix[y][x] + 128, 255);
+		if (x < 0 || x >= m->dx || y < 0 || y >= m->dy)
+			break;
+		if (m->pts && m->npts < NPOINT)
+			m->pts[m->npts++] = y << 9 | x;
+		if (!m->nodraw) {
+			m->hit[m->plane][y][x] = min(m->hit[m->plane][y][x] + 128, 255);
+			m->hitrow[m->plane][y] = 1;
+		}
 		break;
 	case 011:
+		if (m->ctlsrc)
+			m->ctl = SDL_AtomicGet(m->ctlsrc);
+		if (m->movie)
+			m->ctl = movieinput(m->movie, m->nframe, m->ctl);
 		m->io = m->ctl;
 		break;
 	}
 }
 
+/*
+ * Decay the intensity plane by the guest time elapsed up to t.
+ * The factor comes from a table indexed by whole decay steps, and the
+ * leftover time is carried so that short and long frames even out.
+ * Only rows with something still glowing are touched; they are marked as
+ * changed in the next compose pass.
+ */
+void
+fade(Mach *m, u64 t)
+{
+	u8 * p;
+	u64  n;
+	uint f, lit;
+	int  x, y;
+
+	if (t < m->fadetime)
+		m->fadetime = t;
+
+	n = (t - m->fadetime) / DECAYSTEP;
+	if (n == 0)
+		return;
+	m->fadetime += n * DECAYSTEP;
+
+	f = (n < NDECAY) ? m->decay[n] : 0;
+	for (y = 0; y < m->dy; y++) {
+		if (!m->live[y])
+			continue;
+
+		p   = m->pix[y];
+		lit = 0;
+		for (x = 0; x < m->dx; x++) {
+			p[x] = (p[x] * f) >> 8;
+			lit |= p[x];
+		}
+		m->live[y]   = lit != 0;
+		m->rowgen[y] = m->gen + 1;
+	}
+}
+
+/*
+ * Add the points plotted into a hit plane onto the intensity plane and
+ * clear the hit plane so the CPU can plot into it again. Each call is a
+ * new generation, and rows that received points are stamped with it.
+ */
+void
+compose(Mach *m, int plane)
+{
+	u8 *p, *h;
+	int x, y;
+
+	m->gen++;
+	for (y = 0; y < m->dy; y++) {
+		if (!m->hitrow[plane][y])
+			continue;
+
+		p = m->pix[y];
+		h = m->hit[plane][y];
+		for (x = 0; x < m->dx; x++) {
+			p[x] = min(p[x] + h[x], 255);
+			h[x] = 0;
+		}
+		m->hitrow[plane][y] = 0;
+		m->live[y]          = 1;
+		m->rowgen[y]        = m->gen;
+	}
+}
+
 int
 exec(Mach *m, Word inst)
 {
@@ -244,7 +506,10 @@ exec(Mach *m, Word inst)
 				return -ELOOP;
 			ib = (m->mem[y] >> 12) & 1;
 			y  = m->mem[y] & 07777;
+			m->cycles++;
 		}
+		if (op < JMP)
+			m->cycles++;
 	}
 
 	switch (op) {
@@ -264,9 +529,9 @@ exec(Mach *m, Word inst)
 		a = y;
 		if (ib == 0)
 			a = 64;
-		m->mem[a] = m->ac;
-		m->ac     = (m->ov << 17) + m->pc;
-		m->pc     = a + 1;
+		store(m, a, m->ac);
+		m->ac = (m->ov << 17) + m->pc;
+		m->pc = a + 1;
 		break;
 	case LAC:
 		m->ac = m->mem[y];
@@ -275,16 +540,16 @@ exec(Mach *m, Word inst)
 		m->io = m->mem[y];
 		break;
 	case DAC:
-		m->mem[y] = m->ac;
+		store(m, y, m->ac);
 		break;
 	case DAP:
-		m->mem[y] = (m->mem[y] & 0770000) | (m->ac & 07777);
+		store(m, y, (m->mem[y] & 0770000) | (m->ac & 07777));
 		break;
 	case DIO:
-		m->mem[y] = m->io;
+		store(m, y, m->io);
 		break;
 	case DZM:
-		m->mem[y] = 0;
+		store(m, y, 0);
 		break;
 	case ADD:
 		m->ac += m->mem[y];
@@ -299,12 +564,12 @@ exec(Mach *m, Word inst)
 			m->ov = 1;
 		break;
 	case IDX:
-		m->ac     = norm(m->mem[y] + 1);
-		m->mem[y] = m->ac;
+		m->ac = norm(m->mem[y] + 1);
+		store(m, y, m->ac);
 		break;
 	case ISP:
-		m->ac     = norm(m->mem[y] + 1);
-		m->mem[y] = m->ac;
+		m->ac = norm(m->mem[y] + 1);
+		store(m, y, m->ac);
 		if ((m->ac & sign) == 0)
 			m->pc++;
 		break;
@@ -500,8 +765,8 @@ disasm(Inst *ip, Mach *m, u32 a)
 	y        = ip->op & 07777;
 	ib       = (ip->op >> 12) & 1;
 
-	if (m->sym[a] != 0xffffffff) {
-		snprintf(ip->str, sizeof(ip->str), "%s", spacewar_rom[m->sym[a]]);
+	if (romsym[a] != NOSYM && !(m->written[a / 64] & ((u64)1 << (a % 64)))) {
+		snprintf(ip->str, sizeof(ip->str), "%s", spacewar_rom[romsym[a]]);
 		ip->mode = optab[ip->op].mode;
 	} else {
 		if (ip->op < (int)nelem(optab) && optab[ip->op].str) {
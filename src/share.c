@@ -0,0 +1,135 @@
+#include "u.h"
+#include "libc.h"
+#include "dat.h"
+#include "fns.h"
+
+/*
+ * The machine can live in a named shared memory segment so that other
+ * processes can read its registers, memory and intensity plane in place.
+ * The segment starts with a Shared header giving the offsets of the fields
+ * in the Mach that follows it.
+ *
+ * The sequence number is odd while the machine or its display may be
+ * changing and even when both are still at a frame boundary. A reader
+ * waits for an even sequence, reads what it needs, and keeps the result if
+ * the sequence is unchanged afterwards.
+ */
+#define SHAREMAGIC "SWSH"
+
+enum {
+	SHAREVERSION = 1,
+	SHAREHDR     = 4096,
+};
+
+static struct {
+	Shared *s;
+	char *  name;
+	size_t  size;
+	bool    busy;
+} sh;
+
+#if !defined(__WINDOWS__) && !defined(__WINRT__)
+
+int
+openshare(Mach **mp, const char *name)
+{
+	Shared *s;
+	int     fd, ret;
+
+	sh.name = shmname(name);
+	sh.size = SHAREHDR + sizeof(Mach);
+
+	fd = shm_open(sh.name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		ret = -errno;
+		goto err;
+	}
+	if (ftruncate(fd, sh.size) < 0) {
+		ret = -errno;
+		close(fd);
+		shm_unlink(sh.name);
+		goto err;
+	}
+	s = mmap(NULL, sh.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (s == MAP_FAILED) {
+		ret = -errno;
+		shm_unlink(sh.name);
+		goto err;
+	}
+
+	s->version  = SHAREVERSION;
+	s->size     = sh.size;
+	s->machoff  = SHAREHDR;
+	s->machsize = sizeof(Mach);
+	s->ac       = offsetof(Mach, ac);
+	s->io       = offsetof(Mach, io);
+	s->pc       = offsetof(Mach, pc);
+	s->ov       = offsetof(Mach, ov);
+	s->flag     = offsetof(Mach, flag);
+	s->sense    = offsetof(Mach, sense);
+	s->halt     = offsetof(Mach, halt);
+	s->cycles   = offsetof(Mach, cycles);
+	s->nframe   = offsetof(Mach, nframe);
+	s->mem      = offsetof(Mach, mem);
+	s->pix      = offsetof(Mach, pix);
+	s->dx       = offsetof(Mach, dx);
+	s->dy       = offsetof(Mach, dy);
+	SDL_AtomicSet(&s->seq, 1);
+	memcpy(s->magic, SHAREMAGIC, 4);
+
+	sh.s    = s;
+	sh.busy = true;
+	*mp     = (Mach *)((u8 *)s + SHAREHDR);
+	return 0;
+
+err:
+	free(sh.name);
+	return ret;
+}
+
+/* the mapping stays until exit, as other threads may still look at the machine */
+void
+closeshare(void)
+{
+	if (!sh.s)
+		return;
+	shm_unlink(sh.name);
+}
+
+#else
+
+int
+openshare(Mach **mp, const char *name)
+{
+	(void)mp, (void)name;
+	return -ENOSYS;
+}
+
+void
+closeshare(void)
+{
+}
+
+#endif
+
+/* the machine is about to change */
+void
+beginshare(void)
+{
+	if (!sh.busy) {
+		SDL_AtomicIncRef(&sh.s->seq);
+		sh.busy = true;
+	}
+}
+
+/* the machine and its display are at a frame boundary */
+void
+endshare(Mach *m)
+{
+	if (sh.busy) {
+		sh.s->frame = m->nframe;
+		SDL_AtomicIncRef(&sh.s->seq);
+		sh.busy = false;
+	}
+}
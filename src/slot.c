@@ -0,0 +1,237 @@
+#include "u.h"
+#include "libc.h"
+#include "dat.h"
+#include "fns.h"
+
+/*
+ * Save slots are kept in one file, slots.sav, mapped into memory. Each slot
+ * has two copies stamped with a generation counter and a checksum; a save
+ * overwrites the older copy and a load takes the newest copy that checks
+ * out, so a save interrupted half way leaves the previous one intact.
+ * Writing back to disk is left to the OS.
+ */
+#define SLOTMAGIC "SWSL"
+
+enum {
+	SLOTVERSION = 1,
+};
+
+typedef struct {
+	u32 gen;
+	u32 len;
+	u32 sum;
+	u32 pad;
+	u8  data[STATEMAX];
+} Slot;
+
+typedef struct {
+	char magic[4];
+	u32  version;
+	u32  nslot;
+	u32  size;
+	u8   pad[48];
+	Slot slot[NSLOT][2];
+} Slotfile;
+
+static struct {
+	Slotfile *f;
+	bool      mapped;
+	char *    path;
+} st;
+
+static bool
+validslot(Slot *s)
+{
+	return s->gen != 0 && s->len <= sizeof(s->data) && s->sum == checksum(s->data, s->len);
+}
+
+static Slot *
+newest(uint slot)
+{
+	Slot *a, *b;
+
+	a = &st.f->slot[slot][0];
+	b = &st.f->slot[slot][1];
+	if (!validslot(a))
+		return validslot(b) ? b : NULL;
+	if (!validslot(b))
+		return a;
+	return (b->gen > a->gen) ? b : a;
+}
+
+static void
+putslot(uint slot, u8 *buf, size_t n)
+{
+	Slot *s, *t;
+	u32   gen;
+
+	t   = newest(slot);
+	gen = t ? t->gen + 1 : 1;
+	s   = &st.f->slot[slot][t == &st.f->slot[slot][0]];
+
+	s->gen = 0;
+	memcpy(s->data, buf, n);
+	s->len = n;
+	s->sum = checksum(s->data, n);
+	s->gen = gen;
+
+#if !defined(__WINDOWS__) && !defined(__WINRT__)
+	if (st.mapped) {
+		uintptr_t a, e;
+		long      pg;
+
+		pg = sysconf(_SC_PAGESIZE);
+		a  = (uintptr_t)s & ~(uintptr_t)(pg - 1);
+		e  = (uintptr_t)(s->data + n);
+		msync((void *)a, e - a, MS_ASYNC);
+	}
+#endif
+}
+
+/* bring in a save slot file from older versions, one file per slot */
+static void
+importslot(uint slot)
+{
+	Mach * tmp;
+	FILE * fp;
+	u8 *   buf, state[STATEMAX];
+	long   n;
+
+	fp = xfopen("%u.sav", "rb", slot);
+	if (!fp)
+		return;
+
+	buf = NULL;
+	tmp = NULL;
+	if (fseek(fp, 0, SEEK_END) < 0 || (n = ftell(fp)) < 0 || fseek(fp, 0, SEEK_SET) < 0)
+		goto out;
+
+	buf = ecalloc(1, n);
+	if (fread(buf, 1, n, fp) != (size_t)n)
+		goto out;
+
+	tmp = ecalloc(1, sizeof(*tmp));
+	if (loadstate(tmp, buf, n) < 0)
+		goto out;
+	putslot(slot, state, savestate(tmp, state));
+
+out:
+	free(tmp);
+	free(buf);
+	fclose(fp);
+}
+
+static int
+mapslots(void)
+{
+#if !defined(__WINDOWS__) && !defined(__WINRT__)
+	struct stat sb;
+	void *      p;
+	int         fd;
+
+	fd = open(st.path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &sb) < 0 || (sb.st_size != sizeof(Slotfile) && ftruncate(fd, sizeof(Slotfile)) < 0)) {
+		close(fd);
+		return -errno;
+	}
+
+	p = mmap(NULL, sizeof(Slotfile), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return -errno;
+
+	st.f      = p;
+	st.mapped = true;
+	return 0;
+#else
+	FILE *fp;
+
+	st.f = ecalloc(1, sizeof(*st.f));
+	fp   = fopen(st.path, "rb");
+	if (fp) {
+		if (fread(st.f, 1, sizeof(*st.f), fp) != sizeof(*st.f))
+			memset(st.f, 0, sizeof(*st.f));
+		fclose(fp);
+	}
+	return 0;
+#endif
+}
+
+void
+initslots(void)
+{
+	uint i;
+	int  ret;
+
+	st.path = fpath("slots.sav");
+	ret     = mapslots();
+	if (ret < 0) {
+		fprintf(stderr, "Failed to map %s, save slots will not persist: %s\n", st.path, strerror(-ret));
+		st.f = ecalloc(1, sizeof(*st.f));
+	}
+
+	if (memcmp(st.f->magic, SLOTMAGIC, 4) || st.f->version != SLOTVERSION ||
+	    st.f->nslot != NSLOT || st.f->size != STATEMAX) {
+		memset(st.f, 0, sizeof(*st.f));
+		memcpy(st.f->magic, SLOTMAGIC, 4);
+		st.f->version = SLOTVERSION;
+		st.f->nslot   = NSLOT;
+		st.f->size    = STATEMAX;
+		for (i = 0; i < NSLOT; i++)
+			importslot(i);
+	}
+}
+
+void
+syncslots(void)
+{
+	if (!st.f)
+		return;
+
+#if !defined(__WINDOWS__) && !defined(__WINRT__)
+	if (st.mapped) {
+		msync(st.f, sizeof(*st.f), MS_SYNC);
+		return;
+	}
+#else
+	{
+		FILE *fp;
+
+		fp = fopen(st.path, "wb");
+		if (fp) {
+			fwrite(st.f, 1, sizeof(*st.f), fp);
+			fclose(fp);
+		}
+	}
+#endif
+}
+
+int
+savestate_f(Mach *m, uint slot)
+{
+	u8 buf[STATEMAX];
+
+	if (slot >= NSLOT || !st.f)
+		return -EINVAL;
+
+	putslot(slot, buf, savestate(m, buf));
+	return 0;
+}
+
+int
+loadstate_f(Mach *m, uint slot)
+{
+	Slot *s;
+
+	if (slot >= NSLOT || !st.f)
+		return -EINVAL;
+
+	s = newest(slot);
+	if (!s)
+		return -ENOENT;
+
+	return loadstate(m, s->data, s->len);
+}
@@ -0,0 +1,379 @@
+#include "u.h"
+#include "libc.h"
+#include "dat.h"
+#include "fns.h"
+
+/*
+ * Spectators watch through a shared memory ring that the compositor fills
+ * with the tiles of the intensity plane that changed in each shown frame.
+ * There is one writer and any number of readers, and the writer never
+ * waits: readers that fall a ring behind start over at the latest keyframe,
+ * which holds every lit tile.
+ *
+ * The ring is a byte stream of records, each a header and its tiles,
+ * aligned to 16 bytes. A record that does not fit before the end of the
+ * ring is preceded by a wrap record padding out to the end. Positions are
+ * byte counts that wrap at 2^32, and the ring size divides 2^32.
+ */
+#define SPECMAGIC "SWSP"
+
+enum {
+	SPECVERSION = 1,
+	SPECRING    = 8 << 20,
+	SPECKEY     = 60,
+	NTILE       = 512 / TILE,
+	MAXREC      = (16 + NTILE * NTILE * sizeof(Tile) + 15) & ~15,
+};
+
+enum {
+	SKEY  = 1 << 0,
+	SWRAP = 1 << 1,
+};
+
+typedef struct {
+	u32 len;
+	u32 frame;
+	u16 ntile;
+	u8  flags;
+	u8  pad[5];
+} Rechdr;
+
+typedef struct {
+	char         magic[4];
+	u32          version;
+	u32          dx, dy;
+	u32          tile;
+	u32          size;
+	SDL_atomic_t head;
+	SDL_atomic_t key;
+	u8           pad[32];
+	u8           buf[SPECRING];
+} Ring;
+
+struct Spec {
+	Ring *r;
+	u32   pos;
+	u32   rec;
+	uint  n, left;
+};
+
+static struct {
+	Ring *r;
+	char *name;
+	u32   frame;
+	u32   keyframe;
+	u32   gen;
+
+	u8 shadow[512][512];
+	u8 changed[NTILE][NTILE];
+	u8 lit[NTILE][NTILE];
+} pub;
+
+/* true if the writer may have started overwriting the record at rec */
+static bool
+lapped(Spec *s)
+{
+	SDL_MemoryBarrierAcquire();
+	return (u32)SDL_AtomicGet(&s->r->head) - s->rec > SPECRING - 2 * MAXREC;
+}
+
+static void
+restart(Spec *s)
+{
+	s->pos  = SDL_AtomicGet(&s->r->key);
+	s->rec  = s->pos;
+	s->left = 0;
+}
+
+#if !defined(__WINDOWS__) && !defined(__WINRT__)
+
+/* readers map the ring writable too, as SDL may read atomics with a locked add */
+static Ring *
+mapring(const char *name, bool create)
+{
+	Ring *r;
+	int   fd;
+
+	fd = shm_open(name, O_RDWR | (create ? O_CREAT | O_TRUNC : 0), 0644);
+	if (fd < 0)
+		return NULL;
+	if (create && ftruncate(fd, sizeof(Ring)) < 0) {
+		close(fd);
+		shm_unlink(name);
+		return NULL;
+	}
+
+	r = mmap(NULL, sizeof(Ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (r == MAP_FAILED) {
+		if (create)
+			shm_unlink(name);
+		return NULL;
+	}
+	return r;
+}
+
+/* publish the frames shown by m under name, replacing any earlier publisher */
+int
+openspec(const char *name, Mach *m)
+{
+	pub.name = shmname(name);
+	pub.r    = mapring(pub.name, true);
+	if (!pub.r) {
+		free(pub.name);
+		return -errno;
+	}
+
+	pub.r->version = SPECVERSION;
+	pub.r->dx      = m->dx;
+	pub.r->dy      = m->dy;
+	pub.r->tile    = TILE;
+	pub.r->size    = SPECRING;
+	memcpy(pub.r->magic, SPECMAGIC, 4);
+	memset(pub.shadow, 0, sizeof(pub.shadow));
+	memset(pub.lit, 0, sizeof(pub.lit));
+	pub.frame = 0;
+	pub.gen   = 0;
+	return 0;
+}
+
+void
+closespec(void)
+{
+	if (!pub.r)
+		return;
+	munmap(pub.r, sizeof(Ring));
+	shm_unlink(pub.name);
+	free(pub.name);
+	pub.r = NULL;
+}
+
+int
+watchspec(Spec **sp, const char *name)
+{
+	Spec *s;
+	Ring *r;
+	char *n;
+
+	n = shmname(name);
+	r = mapring(n, false);
+	free(n);
+	if (!r)
+		return -errno;
+	if (memcmp(r->magic, SPECMAGIC, 4) || r->version != SPECVERSION || r->tile != TILE ||
+	    r->size != SPECRING) {
+		munmap(r, sizeof(Ring));
+		return -EINVAL;
+	}
+
+	s    = ecalloc(1, sizeof(*s));
+	s->r = r;
+	restart(s);
+	*sp = s;
+	return 0;
+}
+
+void
+unwatchspec(Spec *s)
+{
+	munmap(s->r, sizeof(Ring));
+	free(s);
+}
+
+#else
+
+int
+openspec(const char *name, Mach *m)
+{
+	(void)name, (void)m;
+	return -ENOSYS;
+}
+
+void
+closespec(void)
+{
+}
+
+int
+watchspec(Spec **sp, const char *name)
+{
+	(void)sp, (void)name;
+	return -ENOSYS;
+}
+
+void
+unwatchspec(Spec *s)
+{
+	(void)s;
+}
+
+#endif
+
+/* compare the rows that changed since the last shown frame against what was published */
+static void
+difftiles(Mach *m)
+{
+	u8 *p, *q;
+	int x, y, tx, ty;
+
+	memset(pub.changed, 0, sizeof(pub.changed));
+	for (y = 0; y < m->dy; y++) {
+		if (m->rowgen[y] <= pub.gen)
+			continue;
+
+		ty = y / TILE;
+		p  = m->pix[y];
+		q  = pub.shadow[y];
+		for (tx = 0; tx < m->dx / TILE; tx++) {
+			x = tx * TILE;
+			if (!pub.changed[ty][tx] && memcmp(p + x, q + x, TILE))
+				pub.changed[ty][tx] = 1;
+		}
+	}
+	pub.gen = m->gen;
+}
+
+static void
+puttile(Tile *t, int tx, int ty)
+{
+	int y;
+
+	t->x = tx;
+	t->y = ty;
+	for (y = 0; y < TILE; y++)
+		memcpy(t->pix[y], &pub.shadow[ty * TILE + y][tx * TILE], TILE);
+}
+
+static void
+updatetile(Mach *m, int tx, int ty)
+{
+	u8  lit;
+	int x, y;
+
+	lit = 0;
+	for (y = ty * TILE; y < (ty + 1) * TILE; y++) {
+		memcpy(&pub.shadow[y][tx * TILE], &m->pix[y][tx * TILE], TILE);
+		for (x = tx * TILE; x < (tx + 1) * TILE; x++)
+			lit |= pub.shadow[y][x];
+	}
+	pub.lit[ty][tx] = lit != 0;
+}
+
+/*
+ * Called by the compositor for every shown frame. A keyframe is written
+ * when enough frames or bytes have gone by since the last one that a reader
+ * starting over will still find it in the ring.
+ */
+void
+putspec(Mach *m)
+{
+	Rechdr *h;
+	Ring *  r;
+	u8 *    p;
+	u32     head, off, len, pad;
+	bool    key;
+	int     n, tx, ty;
+
+	r = pub.r;
+	if (!r)
+		return;
+
+	difftiles(m);
+	head = SDL_AtomicGet(&r->head);
+	key  = pub.frame == 0 || pub.frame - pub.keyframe >= SPECKEY ||
+	      head - (u32)SDL_AtomicGet(&r->key) >= SPECRING / 4;
+
+	n = 0;
+	for (ty = 0; ty < m->dy / TILE; ty++) {
+		for (tx = 0; tx < m->dx / TILE; tx++) {
+			if (pub.changed[ty][tx])
+				updatetile(m, tx, ty);
+			if (key ? pub.lit[ty][tx] : pub.changed[ty][tx])
+				n++;
+		}
+	}
+
+	len = (sizeof(*h) + n * sizeof(Tile) + 15) & ~15;
+	off = head % SPECRING;
+	if (SPECRING - off < len) {
+		pad      = SPECRING - off;
+		h        = (Rechdr *)(r->buf + off);
+		h->len   = pad;
+		h->flags = SWRAP;
+		h->ntile = 0;
+		head += pad;
+		off = 0;
+	}
+
+	h        = (Rechdr *)(r->buf + off);
+	h->len   = len;
+	h->frame = pub.frame;
+	h->ntile = n;
+	h->flags = key ? SKEY : 0;
+	p        = (u8 *)(h + 1);
+	for (ty = 0; ty < m->dy / TILE; ty++) {
+		for (tx = 0; tx < m->dx / TILE; tx++) {
+			if (key ? pub.lit[ty][tx] : pub.changed[ty][tx]) {
+				puttile((Tile *)p, tx, ty);
+				p += sizeof(Tile);
+			}
+		}
+	}
+
+	/* the tiles, then the key, then the head; SDL_AtomicSet alone only acquires */
+	SDL_MemoryBarrierRelease();
+	if (key) {
+		SDL_AtomicSet(&r->key, head);
+		pub.keyframe = pub.frame;
+	}
+	SDL_MemoryBarrierRelease();
+	SDL_AtomicSet(&r->head, head + len);
+	pub.frame++;
+}
+
+/*
+ * Get the next published tile. Returns SPECTILE with *t pointing into the
+ * ring, SPECCLEAR when the screen must be cleared before the tiles that
+ * follow, or 0 when there is nothing new. A tile is only good until the
+ * next call, which also notices if it was overwritten while in use and
+ * starts over at the latest keyframe.
+ */
+int
+readspec(Spec *s, Tile **t)
+{
+	Rechdr *h;
+	u32     len;
+	u8      flags;
+	u16     n;
+
+	if (lapped(s))
+		restart(s);
+
+	while (s->left == 0) {
+		if (s->pos == (u32)SDL_AtomicGet(&s->r->head))
+			return 0;
+
+		s->rec = s->pos;
+		h      = (Rechdr *)(s->r->buf + s->rec % SPECRING);
+		len    = h->len;
+		flags  = h->flags;
+		n      = h->ntile;
+		if (lapped(s)) {
+			restart(s);
+			continue;
+		}
+
+		s->pos += len;
+		if (flags & SWRAP)
+			continue;
+		s->n    = n;
+		s->left = n;
+		if (flags & SKEY)
+			return SPECCLEAR;
+	}
+
+	h  = (Rechdr *)(s->r->buf + s->rec % SPECRING);
+	*t = (Tile *)(h + 1) + (s->n - s->left);
+	s->left--;
+	return SPECTILE;
+}
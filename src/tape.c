@@ -0,0 +1,176 @@
+#include "u.h"
+#include "libc.h"
+#include "dat.h"
+#include "fns.h"
+
+/*
+ * Paper tape images, one byte per tape frame. Frames with the eighth hole
+ * punched carry 6 bits of data and three of them make a word; all other
+ * frames (leader, labels) are skipped. A tape starts in RIM format, pairs
+ * of "dio a" and a word to store at a, up to a "jmp start". Whatever
+ * follows is BIN format blocks, "dio first", "dio last+1", the words and a
+ * checksum, up to another "jmp start".
+ */
+typedef struct {
+	u8 *p, *e;
+} Tape;
+
+static int
+getword(Tape *t, Word *w)
+{
+	int n;
+
+	for (*w = n = 0; n < 3; t->p++) {
+		if (t->p >= t->e)
+			return -EINVAL;
+		if (*t->p & 0200) {
+			*w = *w << 6 | (*t->p & 077);
+			n++;
+		}
+	}
+	return 0;
+}
+
+static bool
+moreinput(Tape *t)
+{
+	for (; t->p < t->e; t->p++) {
+		if (*t->p & 0200)
+			return true;
+	}
+	return false;
+}
+
+static Word
+addsum(Word s, Word w)
+{
+	s += w;
+	s += s >> 18;
+	s &= 0777777;
+	if (s == 0777777)
+		s = 0;
+	return s;
+}
+
+static int
+readrim(Tape *t, Word *mem, Word *start)
+{
+	Word w, v;
+
+	for (;;) {
+		if (getword(t, &w) < 0)
+			return -EINVAL;
+		if (w >> 13 == JMP) {
+			*start = w & 07777;
+			return 0;
+		}
+		if (w >> 13 != DIO || getword(t, &v) < 0)
+			return -EINVAL;
+		mem[w & 07777] = v;
+	}
+}
+
+static int
+readbin(Tape *t, Word *mem, Word *start)
+{
+	Word w, e, v, a, sum;
+
+	for (;;) {
+		if (getword(t, &w) < 0)
+			return -EINVAL;
+		if (w >> 13 == JMP) {
+			*start = w & 07777;
+			return 0;
+		}
+		if (w >> 13 != DIO || getword(t, &e) < 0 || e >> 13 != DIO)
+			return -EINVAL;
+
+		sum = addsum(w, e);
+		for (a = w & 07777; a < (e & 07777); a++) {
+			if (getword(t, &v) < 0)
+				return -EINVAL;
+			mem[a] = v;
+			sum    = addsum(sum, v);
+		}
+		if (getword(t, &v) < 0 || v != sum)
+			return -EIO;
+	}
+}
+
+static int
+decode(u8 *buf, size_t size)
+{
+	Word mem[010000], start;
+	Tape t;
+	int  ret;
+
+	memset(mem, 0, sizeof(mem));
+	t.p = buf;
+	t.e = buf + size;
+	if ((ret = readrim(&t, mem, &start)) < 0)
+		return ret;
+	if (moreinput(&t) && (ret = readbin(&t, mem, &start)) < 0)
+		return ret;
+
+	setrom(mem, start);
+	return 0;
+}
+
+/*
+ * Make the program on a RIM/BIN tape the pristine image, replacing Spacewar.
+ * The tape has no source, so the program runs without a source index.
+ */
+int
+loadtape(const char *name)
+{
+#if !defined(__WINDOWS__) && !defined(__WINRT__)
+	struct stat sb;
+	void *      p;
+	int         fd, ret;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &sb) < 0) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+	if (sb.st_size == 0) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	p = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return -errno;
+
+	ret = decode(p, sb.st_size);
+	munmap(p, sb.st_size);
+	return ret;
+#else
+	FILE *fp;
+	u8 *  buf;
+	long  n;
+	int   ret;
+
+	fp = fopen(name, "rb");
+	if (!fp)
+		return -errno;
+
+	buf = NULL;
+	ret = -EINVAL;
+	if (fseek(fp, 0, SEEK_END) < 0 || (n = ftell(fp)) <= 0 || fseek(fp, 0, SEEK_SET) < 0)
+		goto out;
+
+	buf = ecalloc(1, n);
+	if (fread(buf, 1, n, fp) == (size_t)n)
+		ret = decode(buf, n);
+
+out:
+	free(buf);
+	fclose(fp);
+	return ret;
+#endif
+}
@@ -10,6 +10,15 @@ put1(u8 *b, u8 v)
 	return 1;
 }
 
+size_t
+put3(u8 *b, u32 v)
+{
+	b[0] = v & 0xff;
+	b[1] = (v >> 8) & 0xff;
+	b[2] = (v >> 16) & 0xff;
+	return 3;
+}
+
 size_t
 put4(u8 *b, u32 v)
 {
@@ -20,6 +29,19 @@ put4(u8 *b, u32 v)
 	return 4;
 }
 
+size_t
+putv(u8 *b, u32 v)
+{
+	size_t n;
+
+	for (n = 0; v >= 0x80; n++) {
+		b[n] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	b[n++] = v;
+	return n;
+}
+
 size_t
 putm(u8 *dst, u8 *src, size_t size)
 {
@@ -30,10 +52,17 @@ putm(u8 *dst, u8 *src, size_t size)
 size_t
 get1(u8 *b, u8 *v)
 {
-	b[0] = *v;
+	*v = b[0];
 	return 1;
 }
 
+size_t
+get3(u8 *b, u32 *v)
+{
+	*v = (u32)b[0] | (u32)b[1] << 8 | (u32)b[2] << 16;
+	return 3;
+}
+
 size_t
 get4(u8 *b, u32 *v)
 {
@@ -41,6 +70,21 @@ get4(u8 *b, u32 *v)
 	return 4;
 }
 
+/* returns 0 if the varint runs past e or does not fit in 32 bits */
+size_t
+getv(u8 *b, u8 *e, u32 *v)
+{
+	size_t n;
+
+	*v = 0;
+	for (n = 0; b + n < e && n < 5; n++) {
+		*v |= (u32)(b[n] & 0x7f) << (7 * n);
+		if (!(b[n] & 0x80))
+			return n + 1;
+	}
+	return 0;
+}
+
 size_t
 getm(u8 *dst, u8 *src, size_t n)
 {
@@ -48,6 +92,23 @@ getm(u8 *dst, u8 *src, size_t n)
 	return n;
 }
 
+/* FNV-1a */
+u32
+checksum(const void *buf, size_t n)
+{
+	const u8 *p;
+	u32       h;
+	size_t    i;
+
+	p = buf;
+	h = 2166136261u;
+	for (i = 0; i < n; i++) {
+		h ^= p[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
 void
 fatal(const char *fmt, ...)
 {
@@ -128,6 +189,17 @@ ereallocarray(void *optr, size_t nmemb, size_t size)
 	return ptr;
 }
 
+/* a shared memory object name, which must start with a slash */
+char *
+shmname(const char *name)
+{
+	char *s;
+
+	s = ecalloc(1, strlen(name) + 2);
+	sprintf(s, "%s%s", (*name == '/') ? "" : "/", name);
+	return s;
+}
+
 static char *
 trim(char *s)
 {
@@ -168,6 +240,7 @@ static struct {
     {"ppause", "Space", "leftstick"},
     {"pesc", "Escape", "rightstick"},
     {"pframeskip", "`", "back"},
+    {"prewind", "Backspace", "start"},
 };
 
 int
@@ -176,24 +249,34 @@ loadconfig(Controller *ctl, Config *conf, const char *name)
 	char   line[1024], buf[80], *key, *value, *saveptr;
 	FILE * fp;
 	size_t i;
+	u32    keyset, padset;
 	int    n, v;
 
+	memset(ctl->bind, 0, sizeof(ctl->bind));
+	ctl->nbind = 0;
 	for (i = 0; i < nelem(dc); i++) {
-		ctl->key[i]    = SDL_GetKeyFromName(dc[i].key);
-		ctl->button[i] = SDL_GameControllerGetButtonFromString(dc[i].pad);
-		ctl->axis[i]   = -1;
-		if (ctl->button[i] < 0)
-			ctl->axis[i] = SDL_GameControllerGetAxisFromString(dc[i].pad);
+		bindinput(ctl, INPUT(IKEY, 0, SDL_GetKeyFromName(dc[i].key)), i);
+		if ((v = SDL_GameControllerGetButtonFromString(dc[i].pad)) >= 0)
+			bindinput(ctl, INPUT(IBUTTON, 0, v), i);
+		else if ((v = SDL_GameControllerGetAxisFromString(dc[i].pad)) >= 0)
+			bindinput(ctl, INPUT(IAXIS, 0, v), i);
 	}
 	ctl->axis_threshold = 10000;
 	conf->fps           = 60;
 	conf->white         = 0;
 	conf->frameskip     = 1;
+	conf->rewind        = 60 * 60;
+	conf->runahead      = 0;
+	conf->netdelay      = 2;
+	conf->netlag        = 0;
+	conf->netloss       = 0;
 
 	fp = xfopen(name, "rt");
 	if (!fp)
 		return -1;
 
+	/* bindings in the file replace the defaults, and may be given repeatedly */
+	keyset = padset = 0;
 	while (fgets(line, sizeof(line), fp)) {
 		key   = trim(strtok_r(line, "=", &saveptr));
 		value = trim(strtok_r(NULL, "=", &saveptr));
@@ -206,6 +289,21 @@ loadconfig(Controller *ctl, Config *conf, const char *name)
 		} else if (!strcasecmp(key, "white")) {
 			conf->white = atoi(value);
 			continue;
+		} else if (!strcasecmp(key, "rewind")) {
+			conf->rewind = min(strtoul(value, NULL, 10), MAXREWIND);
+			continue;
+		} else if (!strcasecmp(key, "runahead")) {
+			conf->runahead = min(strtoul(value, NULL, 10), MAXRUNAHEAD);
+			continue;
+		} else if (!strcasecmp(key, "net_delay")) {
+			conf->netdelay = min(strtoul(value, NULL, 10), MAXNETDELAY);
+			continue;
+		} else if (!strcasecmp(key, "net_lag")) {
+			conf->netlag = min(strtoul(value, NULL, 10), MAXNETLAG);
+			continue;
+		} else if (!strcasecmp(key, "net_loss")) {
+			conf->netloss = min(strtoul(value, NULL, 10), MAXNETLOSS);
+			continue;
 		} else if (!strcasecmp(key, "axis_threshold")) {
 			ctl->axis_threshold = atof(value);
 			continue;
@@ -214,19 +312,23 @@ loadconfig(Controller *ctl, Config *conf, const char *name)
 		for (i = 0; i < nelem(dc); i++) {
 			snprintf(buf, sizeof(buf), "%s_key", dc[i].str);
 			if (!strcasecmp(buf, key)) {
-				if ((v = SDL_GetKeyFromName(value)) >= 0) {
-					ctl->key[i] = v;
-				}
+				if (!(keyset & (1u << i)))
+					unbindinput(ctl, i, false);
+				keyset |= 1u << i;
+				if ((v = SDL_GetKeyFromName(value)) != SDLK_UNKNOWN)
+					bindinput(ctl, INPUT(IKEY, 0, v), i);
 				break;
 			}
 
 			snprintf(buf, sizeof(buf), "%s_pad", dc[i].str);
-			if (!strcasecmp(buf, key) && sscanf(value, "%d, %32s", &n, buf) == 2) {
-				if ((v = SDL_GameControllerGetButtonFromString(buf)) >= 0) {
-					ctl->button[i] = v | (n << 16);
-				} else if ((v = SDL_GameControllerGetButtonFromString(buf)) >= 0) {
-					ctl->axis[i] = v | (n << 16);
-				}
+			if (!strcasecmp(buf, key) && sscanf(value, "%d, %32s", &n, buf) == 2 && 0 <= n && n < NPAD) {
+				if (!(padset & (1u << i)))
+					unbindinput(ctl, i, true);
+				padset |= 1u << i;
+				if ((v = SDL_GameControllerGetButtonFromString(buf)) >= 0)
+					bindinput(ctl, INPUT(IBUTTON, n, v), i);
+				else if ((v = SDL_GameControllerGetAxisFromString(buf)) >= 0)
+					bindinput(ctl, INPUT(IAXIS, n, v), i);
 				break;
 			}
 		}
@@ -244,29 +346,48 @@ saveconfig(Controller *ctl, Config *conf, const char *name)
 {
 	FILE *      fp;
 	const char *str;
-	size_t      i;
+	Bind *      b;
+	size_t      i, j;
 
 	fp = xfopen(name, "wt");
 	if (!fp)
 		return -1;
 
 	for (i = 0; i < nelem(dc); i++) {
-		str = SDL_GetKeyName(ctl->key[i]);
-		if (str)
-			fprintf(fp, "%s_key = %s\n", dc[i].str, str);
+		for (j = 0; j < NBIND; j++) {
+			b = &ctl->bind[j];
+			if (!(b->act & (1u << i)) || INKIND(b->in) != IKEY)
+				continue;
+			str = SDL_GetKeyName(INCODE(b->in));
+			if (str && *str)
+				fprintf(fp, "%s_key = %s\n", dc[i].str, str);
+		}
 	}
 
 	for (i = 0; i < nelem(dc); i++) {
-		str = SDL_GameControllerGetStringForButton(ctl->button[i]);
-		if (!str)
-			str = SDL_GameControllerGetStringForAxis(ctl->axis[i]);
-		if (str)
-			fprintf(fp, "%s_pad = %s\n", dc[i].str, str);
+		for (j = 0; j < NBIND; j++) {
+			b = &ctl->bind[j];
+			if (!(b->act & (1u << i)))
+				continue;
+			if (INKIND(b->in) == IBUTTON)
+				str = SDL_GameControllerGetStringForButton(INCODE(b->in));
+			else if (INKIND(b->in) == IAXIS)
+				str = SDL_GameControllerGetStringForAxis(INCODE(b->in));
+			else
+				continue;
+			if (str)
+				fprintf(fp, "%s_pad = %d, %s\n", dc[i].str, INPAD(b->in), str);
+		}
 	}
 	fprintf(fp, "axis_threshold = %d\n", ctl->axis_threshold);
 
 	fprintf(fp, "fps = %lf\n", conf->fps);
 	fprintf(fp, "white = %d\n", conf->white);
+	fprintf(fp, "rewind = %u\n", conf->rewind);
+	fprintf(fp, "runahead = %u\n", conf->runahead);
+	fprintf(fp, "net_delay = %u\n", conf->netdelay);
+	fprintf(fp, "net_lag = %u\n", conf->netlag);
+	fprintf(fp, "net_loss = %u\n", conf->netloss);
 
 	fclose(fp);
 	return 0;
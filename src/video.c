@@ -0,0 +1,211 @@
+#include "u.h"
+#include "libc.h"
+#include "dat.h"
+#include "fns.h"
+
+/*
+ * Frames from the intensity plane are queued to a writer thread that owns
+ * the output file. Consecutive identical frames are folded into a repeat
+ * count so that they are only copied once, and written out that many times.
+ */
+enum {
+	NQUEUE = 8,
+};
+
+typedef struct {
+	int  n;
+	bool dup;
+	bool taken;
+	u8   pix[512 * 512];
+} Vframe;
+
+static struct {
+	SDL_Thread *thread;
+	SDL_mutex * lock;
+	SDL_cond *  cond;
+	FILE *      fp;
+	bool        y4m;
+	bool        block;
+	bool        done;
+	int         dx, dy;
+
+	Vframe q[NQUEUE];
+	int    head, count;
+	u32    gen;
+	u64    drops;
+
+	u8  held[512 * 512];
+	int nheld;
+} vid;
+
+static void
+emit(void)
+{
+	size_t size;
+	int    i;
+
+	if (vid.nheld == 0)
+		return;
+
+	size = vid.dx * vid.dy;
+	for (i = 0; i < vid.nheld; i++) {
+		if (vid.y4m)
+			fprintf(vid.fp, "FRAME\n");
+		fwrite(vid.held, 1, size, vid.fp);
+	}
+	vid.nheld = 0;
+}
+
+static int
+writer(void *arg)
+{
+	Vframe *f;
+	int     n;
+
+	(void)arg;
+	for (;;) {
+		SDL_LockMutex(vid.lock);
+		while (vid.count == 0 && !vid.done)
+			SDL_CondWait(vid.cond, vid.lock);
+		if (vid.count == 0) {
+			SDL_UnlockMutex(vid.lock);
+			break;
+		}
+		f        = &vid.q[vid.head];
+		f->taken = true;
+		n        = f->n;
+		SDL_UnlockMutex(vid.lock);
+
+		if (f->dup)
+			vid.nheld += n;
+		else {
+			emit();
+			memcpy(vid.held, f->pix, vid.dx * vid.dy);
+			vid.nheld = n;
+		}
+
+		SDL_LockMutex(vid.lock);
+		vid.head = (vid.head + 1) % NQUEUE;
+		vid.count--;
+		SDL_CondBroadcast(vid.cond);
+		SDL_UnlockMutex(vid.lock);
+	}
+
+	emit();
+	fflush(vid.fp);
+	return 0;
+}
+
+int
+openvideo(const char *name, Mach *m, double fps, bool block)
+{
+	const char *ext;
+
+	if (vid.fp)
+		return -EBUSY;
+
+	if (!strcmp(name, "-"))
+		vid.fp = stdout;
+	else
+		vid.fp = fopen(name, "wb");
+	if (!vid.fp)
+		return -errno;
+
+	ext     = strrchr(name, '.');
+	vid.y4m = !ext || (strcasecmp(ext, ".raw") && strcasecmp(ext, ".gray"));
+	vid.dx  = m->dx;
+	vid.dy  = m->dy;
+	vid.gen = 0;
+
+	vid.block = block;
+	vid.lock  = SDL_CreateMutex();
+	vid.cond  = SDL_CreateCond();
+	if (!vid.lock || !vid.cond)
+		fatal("Failed to create video writer lock: %s", SDL_GetError());
+
+	if (vid.y4m)
+		fprintf(vid.fp, "YUV4MPEG2 W%d H%d F%d:1000 Ip A1:1 Cmono\n", vid.dx, vid.dy, (int)(fps * 1000));
+
+	vid.thread = SDL_CreateThread(writer, "video", NULL);
+	if (!vid.thread)
+		fatal("Failed to create video writer thread: %s", SDL_GetError());
+
+	return 0;
+}
+
+/*
+ * Queue the intensity plane as the next frame. A frame is a repeat of the
+ * previous one if no row changed since it was queued. If the queue is full
+ * and we are not allowed to block, the frame is dropped and the last queued
+ * frame is shown once more in its place, unless the writer has already
+ * taken it, in which case we wait after all.
+ */
+void
+putvideo(Mach *m)
+{
+	Vframe *f;
+	bool    dup;
+	int     y;
+
+	if (!vid.thread)
+		return;
+
+	dup = vid.gen != 0;
+	for (y = 0; y < m->dy && dup; y++) {
+		if (m->rowgen[y] > vid.gen)
+			dup = false;
+	}
+
+	SDL_LockMutex(vid.lock);
+	f = &vid.q[(vid.head + NQUEUE - 1) % NQUEUE];
+	if (vid.count == NQUEUE && !vid.block && !f->taken) {
+		f->n++;
+		vid.drops++;
+		SDL_UnlockMutex(vid.lock);
+		return;
+	}
+	while (vid.count == NQUEUE)
+		SDL_CondWait(vid.cond, vid.lock);
+	vid.gen = m->gen;
+
+	f = &vid.q[(vid.head + vid.count + NQUEUE - 1) % NQUEUE];
+	if (dup && vid.count > 0 && !f->taken) {
+		f->n++;
+		SDL_UnlockMutex(vid.lock);
+		return;
+	}
+	SDL_UnlockMutex(vid.lock);
+
+	f        = &vid.q[(vid.head + vid.count) % NQUEUE];
+	f->n     = 1;
+	f->dup   = dup;
+	f->taken = false;
+	if (!dup)
+		memcpy(f->pix, m->pix, m->dx * m->dy);
+
+	SDL_LockMutex(vid.lock);
+	vid.count++;
+	SDL_CondBroadcast(vid.cond);
+	SDL_UnlockMutex(vid.lock);
+}
+
+void
+closevideo(void)
+{
+	if (!vid.thread)
+		return;
+
+	SDL_LockMutex(vid.lock);
+	vid.done = true;
+	SDL_CondBroadcast(vid.cond);
+	SDL_UnlockMutex(vid.lock);
+
+	SDL_WaitThread(vid.thread, NULL);
+	vid.thread = NULL;
+
+	if (vid.drops)
+		fprintf(stderr, "video: %llu frames dropped\n", (unsigned long long)vid.drops);
+	if (vid.fp != stdout)
+		fclose(vid.fp);
+	vid.fp = NULL;
+}